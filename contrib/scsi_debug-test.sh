@@ -0,0 +1,139 @@
+#!/bin/bash
+#
+# scsi_debug-test.sh - end-to-end test of hd-idle with virtual SCSI disks
+#
+# Loads the scsi_debug kernel module with N disks, runs hd-idle on them,
+# issues I/O on every other disk halfway through the idle time and checks
+# that each disk is spun down once, within the expected window. For each N,
+# the CPU time per poll and the actuation throughput (spin-downs per second
+# of spin-down commands) are reported. Needs root and must not be run while
+# scsi_debug is in use otherwise; use a test system or a virtual machine.
+#
+# This script is untested: it has only been checked against synthetic logs,
+# not run with the scsi_debug module. Treat failures as possibly its own.
+#
+# usage: scsi_debug-test.sh [hd-idle binary]
+#
+# Environment: SIZES (numbers of disks, default "8 64 512", N > 8 must be a
+# multiple of 8), IDLE (idle time in seconds, default 20), TOL (additional
+# tolerance in seconds, default 3)
+
+HD_IDLE=${1:-./hd-idle}
+SIZES=${SIZES:-"8 64 512"}
+IDLE=${IDLE:-20}
+TOL=${TOL:-3}
+
+POLL=$(( IDLE / 10 > 0 ? IDLE / 10 : 1 ))
+LOG=$(mktemp /tmp/hd-idle-test.XXXXXX)
+pid=
+failed=0
+
+cleanup()
+{
+  if [ -n "$pid" ]; then
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+  fi
+  if [ -d /sys/module/scsi_debug ]; then
+    udevadm settle 2>/dev/null
+    rmmod scsi_debug
+  fi
+  rm -f "$LOG"
+}
+
+die()
+{
+  echo "error: $*" >&2
+  exit 2
+}
+
+[ "$(id -u)" = 0 ] || die "must be run as root"
+[ -x "$HD_IDLE" ] || die "$HD_IDLE not found, run make first"
+[ -d /sys/module/scsi_debug ] && die "scsi_debug is already loaded"
+trap cleanup EXIT
+trap 'exit 2' INT TERM
+
+for n in $SIZES; do
+  if [ "$n" -le 8 ]; then
+    tgts=1
+    luns=$n
+  else
+    tgts=$(( n / 8 ))
+    luns=8
+  fi
+
+  modprobe scsi_debug dev_size_mb=1 num_tgts=$tgts max_luns=$luns ||
+    die "can't load scsi_debug"
+  udevadm settle 2>/dev/null
+
+  disks=$(grep -l scsi_debug /sys/block/sd*/device/model 2>/dev/null | cut -d/ -f4)
+  found=$(echo $disks | wc -w)
+  [ "$found" -eq "$n" ] || die "expected $n virtual disks, found $found"
+
+  # only the virtual disks are managed; timestamp each line of debug output
+  "$HD_IDLE" -d -i 0 $(for d in $disks; do echo -a $d -i $IDLE; done) > >(
+    while IFS= read -r line; do
+      printf '%(%s)T %s\n' -1 "$line"
+    done > "$LOG") &
+  pid=$!
+  start=$(date +%s)
+
+  # I/O on every other disk halfway through the idle time
+  sleep $(( IDLE / 2 ))
+  busy=$(for d in $disks; do echo $d; done | sed -n 'n;p')
+  io=$(date +%s)
+  for d in $busy; do
+    dd if=/dev/$d of=/dev/null bs=4k count=1 iflag=direct 2>/dev/null
+  done
+
+  # wait for the second half plus two polls and the tolerance
+  sleep $(( io + IDLE + 2 * POLL + TOL + 1 - $(date +%s) ))
+  kill "$pid" 2>/dev/null
+  wait "$pid" 2>/dev/null
+  pid=
+  sleep 1
+
+  # Each disk must be spun down once: idle disks between the idle time and
+  # two polls (plus tolerance) after startup, busy disks likewise after the
+  # I/O. The disk is added by the first poll and the I/O is only seen by the
+  # poll after it, hence two polls.
+  echo $busy | awk -v n="$n" -v start="$start" -v io="$io" -v idle="$IDLE" \
+                   -v poll="$POLL" -v tol="$TOL" -v disks="$(echo $disks)" '
+    FILENAME == "-" { for (i = 1; i <= NF; i++) busy[$i] = 1; next }
+    $2 == "spindown:" {
+      d = $3; t = $1;
+      if (d in count) {
+        printf("%s: spun down again at +%d s\n", d, t - start); bad++;
+      } else {
+        stopped++;
+      }
+      count[d]++;
+      from = ((d in busy) ? io : start) + idle;
+      if (t < from || t > from + 2 * poll + tol) {
+        printf("%s: spun down at +%d s, expected +%d..+%d s\n", d, t - start,
+               from - start, from + 2 * poll + tol - start);
+        bad++;
+      }
+    }
+    $2 == "poll:" {
+      # "<time> poll: <n> disk(s), <us> us CPU, <k> spin-down(s) in <us> us"
+      polls++; cpu += $5; if ($5 > cpu_max) cpu_max = $5;
+      stops += $8; act += $11;
+    }
+    END {
+      split(disks, all, " ");
+      for (i in all) {
+        if (!(all[i] in count)) { printf("%s: not spun down\n", all[i]); bad++; }
+      }
+      printf("N=%d: %d/%d disk(s) spun down, %d problem(s), ", n, stopped, n, bad);
+      printf("poll CPU avg %d us max %d us, ", (polls > 0) ? cpu / polls : 0, cpu_max);
+      printf("actuation %.0f spin-downs/s (%d in %d us)\n",
+             (act > 0) ? stops * 1000000 / act : 0, stops, act);
+      exit(bad > 0);
+    }' - "$LOG" || failed=1
+
+  udevadm settle 2>/dev/null
+  rmmod scsi_debug || die "can't remove scsi_debug"
+done
+
+exit $failed
@@ -0,0 +1,59 @@
+/*
+ * hd-idle-probes.h - static tracepoints (USDT) for hd-idle
+ *
+ * Copyright (c) 2007 Christian Mueller.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Probes use <sys/sdt.h> (systemtap-sdt-dev on Debian) if it's available at
+ * build time, otherwise (or with -DHD_IDLE_NO_PROBES) they compile to
+ * nothing. An SDT probe is a single nop plus an ELF note describing where to
+ * find its arguments, thus it costs next to nothing unless a tracer such as
+ * bpftrace or perf is attached. All probes belong to the provider "hd_idle":
+ *
+ *   poll_start                            start of a poll
+ *   poll_end(disks, spindowns)            end of a poll
+ *   activity(disk, reads, writes)         I/O on a disk since the last poll
+ *   spindown_issue(disk)                  before sending the spin-down command
+ *   spindown_done(disk, rc, us)           after the spin-down command
+ *   spinup(disk, stopped)                 disk spun up after 'stopped' s
+ *
+ * See contrib/bpftrace for examples.
+ */
+
+#ifndef HD_IDLE_PROBES_H
+#define HD_IDLE_PROBES_H
+
+#if !defined(HD_IDLE_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef DTRACE_PROBE
+#define PROBE(name)              DTRACE_PROBE(hd_idle, name)
+#define PROBE1(name, a)          DTRACE_PROBE1(hd_idle, name, a)
+#define PROBE2(name, a, b)       DTRACE_PROBE2(hd_idle, name, a, b)
+#define PROBE3(name, a, b, c)    DTRACE_PROBE3(hd_idle, name, a, b, c)
+#else
+#define PROBE(name)              do { } while (0)
+#define PROBE1(name, a)          do { (void) (a); } while (0)
+#define PROBE2(name, a, b)       do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name, a, b, c)    do { (void) (a); (void) (b); (void) (c); } while (0)
+#endif
+
+#endif /* HD_IDLE_PROBES_H */
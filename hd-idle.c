@@ -106,6 +106,8 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -116,16 +118,81 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <signal.h>
+#include <dirent.h>
+#include <poll.h>
 
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mount.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <scsi/sg.h>
 #include <scsi/scsi.h>
 
+#include "hd-idle-probes.h"
+
 #define DEFAULT_IDLE_TIME 600
 static const char STAT_FILE[] = "/proc/diskstats";
+static const char CGROUP_ROOT[] = "/sys/fs/cgroup";
+static const char SYSFS_BLOCK[] = "/sys/block";
+static const char MOUNT_FILE[] = "/proc/self/mountinfo";
+static const char RUN_DIR[] = "/run/hd-idle";
+static const char ATIME_JOURNAL[] = "/run/hd-idle/atime";
+static const char WBUF_JOURNAL[] = "/run/hd-idle/dirty_expire";
+static const char SMART_FILE[] = "/run/hd-idle/smart-";
+
+/* time to wait for the I/O caused by an unmount to settle */
+#define UNMOUNT_SETTLE 10
+
+/* streaming detection: number of consecutive polls with sequential reads
+ * below the given rate and the read-ahead to use while streaming
+ */
+#define STREAM_POLLS       3
+#define STREAM_MAX_RATE    2048   /* KiB/s */
+#define STREAM_READ_AHEAD  "16384" /* KiB */
+
+/* histograms of the main loop's timing (see hist_add()) */
+#define HIST_BUCKETS       32
+#define H_LAG              0  /* actual minus planned wakeup */
+#define H_PARSE            1  /* reading and parsing the disk statistics */
+#define H_DECIDE           2  /* deciding what to do with each disk */
+#define H_ACTUATE          3  /* each spin-down command */
+#define H_LOG              4  /* each write to the logfile */
+#define H_MAX              5
+
+/* activity history (see rrd_open()): per minute for a day and per hour for
+ * a year, for up to RRD_DISKS disks, plus an hour-of-week heatmap which
+ * decays by HEAT_DECAY per week
+ */
+#define RRD_MAGIC          0x52444948  /* "HIDR" */
+#define RRD_VERSION        2
+#define RRD_DISKS          32
+#define RRD_MINUTES        1440
+#define RRD_HOURS          8760
+#define HEAT_HOURS         168
+#define HEAT_DECAY         0.8409  /* halved in 4 weeks */
+
+/* power states for wake latency budgets (see pick_pstate()), shallowest
+ * first; the exit latencies are defaults, refined by actual wakes
+ */
+#define PS_IDLE_B          0  /* heads unloaded */
+#define PS_IDLE_C          1  /* heads unloaded, reduced speed */
+#define PS_STANDBY         2  /* stopped */
+#define PS_MAX             3
+#define PS_CAP             3  /* max. learned sample, times the default */
+
+/* sg_command() result when a device rejects a command as invalid */
+#define SG_REJECTED        -2
+
+/* time to wait before buffering writes again after a flush */
+#define WBUF_SETTLE        30
 
 #define dprintf(...) do { if (debug) { printf(__VA_ARGS__); } } while (0)
 #define _return(i) do { rc = i; goto out; } while (0)
@@ -135,38 +202,394 @@ typedef struct idle_time_t {
   struct idle_time_t   *next;
   char                 *name;
   int                  idle_time;
+  int                  latency;
   unsigned int         name_allocd : 1;
+  unsigned int         mount : 1;
 } idle_time_t;
 
+typedef struct cgroup_t {
+  struct cgroup_t      *next;
+  char                 *path;
+  int                  fd;
+  unsigned int         present : 1;
+} cgroup_t;
+
+typedef struct cgroup_io_t {
+  unsigned int         major;
+  unsigned int         minor;
+  unsigned int         rios;
+  unsigned int         wios;
+} cgroup_io_t;
+
+typedef struct profile_t {
+  const char           *name;
+  int                  idle_time;
+} profile_t;
+
+typedef struct quirk_t {
+  struct quirk_t       *next;
+  unsigned int         vid;
+  unsigned int         pid;
+  const char           *model;
+  unsigned int         flags;
+  int                  timeout;
+} quirk_t;
+
+/* quirk flags */
+#define Q_IMMED        0x01  /* STOP UNIT with IMMED (return before stopping) */
+#define Q_ATA_STANDBY  0x02  /* STOP UNIT ignored; use ATA STANDBY IMMEDIATE */
+#define Q_PT           0x04  /* ATA pass-through is safe */
+#define Q_NO_PT        0x08  /* ATA pass-through is unsafe (e.g. hangs bridge) */
+
+typedef struct histogram_t {
+  const char           *name;
+  unsigned long        count;
+  unsigned long long   sum;
+  unsigned long        max;
+  unsigned long        bucket[HIST_BUCKETS];
+} histogram_t;
+
+typedef struct mount_t {
+  struct mount_t       *next;
+  unsigned int         major;
+  unsigned int         minor;
+  char                 *target;
+} mount_t;
+
+typedef struct remount_t {
+  struct remount_t     *next;
+  char                 *disk;
+  char                 *target;
+  unsigned long        flags;
+} remount_t;
+
+typedef struct sysfs_attr_t {
+  struct sysfs_attr_t  *next;
+  char                 *path;
+  char                 value[32];
+} sysfs_attr_t;
+
+typedef struct mirror_t {
+  struct mirror_t      *next;
+  char                 md[NAME_MAX + 1];
+  char                 dev[NAME_MAX + 1];
+  char                 disk[50];
+  unsigned long        spinups;
+  unsigned long        before;     /* spin-ups before read steering */
+  time_t               before_secs;
+  time_t               since;      /* last rotation */
+  unsigned int         primary : 1;
+  unsigned int         was_wm : 1;
+} mirror_t;
+
+typedef struct path_io_t {
+  unsigned int         reads;
+  unsigned int         writes;
+  unsigned int         read_merges;
+  unsigned int         read_sectors;
+  unsigned int         write_sectors;
+  unsigned int         in_flight;
+  unsigned int         io_ticks;
+  unsigned int         in_queue;
+  unsigned int         cg_reads;
+  unsigned int         cg_writes;
+} path_io_t;
+
+typedef struct rrd_row_t {
+  uint32_t             slot;       /* minutes or hours since the epoch */
+  uint32_t             ops;
+  uint32_t             sectors;
+  uint32_t             stopped;    /* seconds spun down */
+} rrd_row_t;
+
+typedef struct rrd_heat_t {
+  uint32_t             week;       /* weeks since the epoch of last update */
+  float                active;     /* seconds with I/O */
+  float                spinups;
+} rrd_heat_t;
+
+typedef struct rrd_disk_t {
+  char                 name[52];
+  rrd_row_t            minute[RRD_MINUTES];
+  rrd_row_t            hour[RRD_HOURS];
+  rrd_heat_t           heat[HEAT_HOURS];
+} rrd_disk_t;
+
+typedef struct rrd_t {
+  uint32_t             magic;
+  uint32_t             version;
+  uint32_t             disks;
+  uint32_t             minutes;
+  uint32_t             hours;
+  uint32_t             reserved;
+  rrd_disk_t           disk[RRD_DISKS];
+} rrd_t;
+
 typedef struct disk_stats_t {
   struct disk_stats_t  *next;
+  struct disk_stats_t  *mpath;
+  struct disk_stats_t  *next_path;
+  path_io_t            *io;
+  sysfs_attr_t         *saved;
+  sysfs_attr_t         *rpm_saved;
   char                 name[50];
+  const char           *transport;
+  const char           *profile;
+  const quirk_t        *quirk;
+  rrd_disk_t           *rrd;
   int                  idle_time;
+  int                  latency;
+  int                  mount_latency;
+  int                  exit_ms[PS_MAX];
   time_t               last_io;
   time_t               spindown;
   time_t               spinup;
+  time_t               last_poll;
+  time_t               stop_at;
+  time_t               retry_at;
+  time_t               wbuf_since;
+  time_t               smart_at;
+  int                  mounts;
+  int                  stream_polls;
+  int                  paths;
+  int                  pending;
+  int                  mount_idle;
+  unsigned long        spinups;
+  long long            trace_ts;
+  int                  trace_tid;
+  unsigned int         major;
+  unsigned int         minor;
   unsigned int         reads;
   unsigned int         writes;
+  unsigned int         read_merges;
+  unsigned int         read_sectors;
+  unsigned int         write_sectors;
+  unsigned int         in_flight;
+  unsigned int         io_ticks;
+  unsigned int         in_queue;
+  unsigned int         cg_reads;
+  unsigned int         cg_writes;
+  unsigned int         cg_gen;
+  unsigned int         probed : 1;
+  unsigned int         rpm : 1;
+  unsigned int         restart_ok : 1;
+  unsigned int         seen : 1;
+  unsigned int         was_mounted : 1;
+  unsigned int         mount_rule : 1;
+  unsigned int         streaming : 1;
+  unsigned int         wbuf : 1;
   unsigned int         spun_down : 1;
+  unsigned int         trace_busy : 1;
+  unsigned int         pstate : 2;
+  unsigned int         no_pstate : 1;
 } disk_stats_t;
 
 /* function prototypes */
 static void         daemonize      (void);
+static void         close_fds      (int lowfd);
 static disk_stats_t *get_diskstats (disk_stats_t *ds, const char *name);
-static void         spindown_disk  (const char *name);
+static int          spindown_disk  (const char *name, const quirk_t *q);
+static int          start_disk     (const char *name, const quirk_t *q);
+static int          sg_command     (const char *name, const unsigned char *cdb,
+                                    int cdb_len, unsigned char *data,
+                                    int data_len, int timeout);
+static const quirk_t *find_quirk   (const char *name);
+static int          quirk_match    (const quirk_t *q, unsigned int vid,
+                                    unsigned int pid, const char *model);
+static int          add_quirk      (const char *arg);
+static int          ata_pt_safe    (disk_stats_t *ds);
 static void         log_spinup     (const char *logfile, disk_stats_t *ds);
 static char         *disk_name     (char *name);
 static void         phex           (FILE *fp, const void *p, int len,
                                     const char *fmt, ...);
-static int          is_scsi_disk   (const char *ds);
+static int          is_scsi_disk   (unsigned int major, unsigned int minor);
+static cgroup_t     *open_cgroup   (const char *path);
+static void         read_cgroups   (cgroup_t *cg);
+static cgroup_io_t  *get_cgroup_io (unsigned int major, unsigned int minor);
+static time_t       estimate_last_io(disk_stats_t *ds, disk_stats_t *tmp,
+                                    time_t now);
+static int          sysfs_read     (char *buf, int len, const char *fmt, ...);
+static const char   *disk_transport(const char *name);
+static const char   *disk_profile  (const char *name, const char *transport);
+static int          check_restart  (disk_stats_t *ds);
+static int          find_idle_time (idle_time_t *it, disk_stats_t *ds,
+                                    int *latency);
+static int          pick_pstate    (disk_stats_t *ds);
+static void         learn_pstate   (disk_stats_t *ds, unsigned int ticks,
+                                    time_t secs);
+static int          idle_disk      (const char *name, int ps, const quirk_t *q);
+static char         *mount_rule    (const char *arg);
+static void         resolve_rules  (idle_time_t *it_root, mount_t *mnt,
+                                    disk_stats_t *ds_root);
+static void         attach_disk    (disk_stats_t *ds, disk_stats_t *ds_root,
+                                    idle_time_t *it_root);
+static void         detach_disk    (disk_stats_t *ds);
+static int          mpath_merge    (disk_stats_t *ds, disk_stats_t *ds_root);
+static int          mpath_collect  (disk_stats_t *ds, disk_stats_t *tmp);
+static void         mpath_split    (disk_stats_t *lg, disk_stats_t *gone);
+static const char   *mpath_name    (disk_stats_t *ds);
+static void         path_io_save   (path_io_t *io, const disk_stats_t *src);
+static void         path_io_add    (disk_stats_t *dst, const path_io_t *io);
+static void         path_io_load   (disk_stats_t *dst, const path_io_t *io);
+static int          scsi_disk_dir  (const char *name, char *buf, int len);
+static int          sysfs_write    (const char *value, const char *fmt, ...);
+static int          sysfs_set      (sysfs_attr_t **saved, const char *value,
+                                    const char *fmt, ...);
+static void         sysfs_restore  (sysfs_attr_t **saved);
+static void         sysfs_unset    (sysfs_attr_t **saved, const char *fmt, ...);
+static void         restore_attr   (sysfs_attr_t **sap);
+static void         stream_check   (disk_stats_t *ds, disk_stats_t *tmp,
+                                    time_t now);
+static void         stream_end     (disk_stats_t *ds);
+static void         smart_collect  (disk_stats_t *ds, time_t now);
+static void         wbuf_start     (disk_stats_t *ds, time_t now);
+static void         wbuf_end       (disk_stats_t *ds);
+static long         dirty_limit    (const char *name);
+static int          runtime_pm_setup(disk_stats_t *ds);
+static void         events_poll_setup(disk_stats_t *ds);
+static long         elapsed_us     (clockid_t clk, const struct timespec *since);
+static long long    mono_ns        (void);
+static void         hist_add       (histogram_t *h, long long us);
+static void         hist_dump      (FILE *fp);
+static void         hist_metrics   (const char *path);
+static long long    real_us        (void);
+static int          rrd_open       (const char *path);
+static void         rrd_close      (void);
+static void         rrd_attach     (disk_stats_t *ds);
+static void         rrd_update     (disk_stats_t *ds, unsigned int ops,
+                                    unsigned int sectors, time_t now);
+static void         rrd_add        (rrd_row_t *row, uint32_t slot,
+                                    unsigned int ops, unsigned int sectors,
+                                    unsigned int stopped);
+static void         heat_add       (rrd_heat_t *h, time_t now, unsigned int active,
+                                    unsigned int spinups);
+static double       heat_decay     (uint32_t week, time_t now);
+static int          hour_of_week   (time_t t);
+static const rrd_t  *rrd_map       (const char *path);
+static int          rrd_dump       (const char *path);
+static int          heat_dump      (const char *path);
+static void         heat_print     (const rrd_disk_t *d, const char *what,
+                                    int spinups, time_t now);
+static void         rrd_print      (const rrd_disk_t *d, const char *period,
+                                    const rrd_row_t *rows, int n, uint32_t last,
+                                    int secs);
+static int          trace_open     (const char *path);
+static void         trace_close    (disk_stats_t *ds_root);
+static void         trace_event    (disk_stats_t *ds, int ph, const char *name,
+                                    long long ts, const char *fmt, ...);
+static void         trace_start    (disk_stats_t *ds);
+static void         trace_end      (disk_stats_t *ds);
+static void         trace_stop     (disk_stats_t *ds, long long us, int rc);
+static void         trace_wake     (disk_stats_t *ds);
+static void         trace_io       (disk_stats_t *ds, unsigned int reads,
+                                    unsigned int writes, time_t secs);
+static int          notify_init    (void);
+static void         notify         (const char *fmt, ...);
+static time_t       disk_deadline  (disk_stats_t *ds);
+static mount_t      *read_mounts   (int fd);
+static void         free_mounts    (mount_t *mnt);
+static void         count_mounts   (mount_t *mnt, disk_stats_t *ds_root);
+static void         dev_disks      (unsigned int major, unsigned int minor,
+                                    void (*fn)(const char *disk, void *arg),
+                                    void *arg);
+static void         sysfs_disks    (const char *path, int depth,
+                                    void (*fn)(const char *disk, void *arg),
+                                    void *arg);
+static int          dir_empty      (const char *path);
+static int          has_holders    (const char *name);
+static void         atime_suppress (disk_stats_t *ds, mount_t *mnt);
+static void         atime_restore  (const char *disk);
+static void         atime_journal  (void);
+static void         atime_replay   (void);
+static void         wbuf_journal   (const char *value);
+static void         wbuf_replay    (void);
+static mirror_t     *mirror_scan   (void);
+static mirror_t     *mirror_rotate (mirror_t *old, disk_stats_t *ds_root,
+                                    time_t started);
+static void         mirror_restore (mirror_t *m, disk_stats_t *ds_root);
+static void         mirror_report  (mirror_t *m, disk_stats_t *ds_root);
+static int          mirror_state   (mirror_t *m, const char *value);
+static time_t       next_wakeup    (disk_stats_t *ds, time_t polled, time_t poll,
+                                    int slack, int *merged);
+static time_t       due_time       (disk_stats_t *ds, time_t polled, time_t poll);
+
+/* Automatic profiles; the default idle time is only used with "-A", otherwise
+ * profiles are merely a way to name disks with "-a @<profile>"
+ */
+static profile_t profiles[] = {
+  { "usb-hdd",     DEFAULT_IDLE_TIME },
+  { "sata-hdd",    3 * DEFAULT_IDLE_TIME },
+  { "ssd",         0 },
+  { "card-reader", 0 },
+  { NULL,          0 }
+};
+
+/* Bridge and drive quirks, matched once per disk on attach by USB vendor and
+ * product ID and (optionally) a prefix of the model name. Entries added with
+ * "-q" are checked first. A timeout of 0 means the kernel's default.
+ */
+static quirk_t quirks[] = {
+  /* SAT bridges with working ATA pass-through (per smartmontools) */
+  { NULL, 0x152d, 0x2329, NULL, Q_PT,    0 },  /* JMicron JM20329 */
+  { NULL, 0x152d, 0x2338, NULL, Q_PT,    0 },  /* JMicron JM20337/8 */
+  { NULL, 0x152d, 0x0578, NULL, Q_PT,    0 },  /* JMicron JMS578 */
+  { NULL, 0x174c, 0x55aa, NULL, Q_PT,    0 },  /* ASMedia ASM1051/1053 */
+  /* bridges with vendor-specific pass-through, thus unsafe to use SAT */
+  { NULL, 0x04b4, 0x6830, NULL, Q_NO_PT, 0 },  /* Cypress CY7C68300 */
+  { NULL, 0x04fc, 0x0c25, NULL, Q_NO_PT, 0 },  /* Sunplus SPIF225 */
+  { NULL, 0x067b, 0x2507, NULL, Q_NO_PT, 0 },  /* Prolific PL2507 */
+  { NULL, 0, 0, NULL, 0, 0 }
+};
+static quirk_t *user_quirks;
+
+/* names and default exit latencies (ms) of the power states */
+static const char *ps_names[PS_MAX] = { "idle_b", "idle_c", "standby" };
+static const int ps_exit_ms[PS_MAX] = { 500, 3000, 10000 };
 
 /* global/static variables */
 static int debug =  0;
+static int auto_profile = 0;
+static int runtime_pm = 0;
+static int scsi_restart = 0;
+static int no_events_poll = 0;
+static int noatime = 0;
+static int stream_timeout = -1;
+static int wbuf_age = -1;
+static long wbuf_size = 1024;
+static int wbuf_disks = 0;
+static int mirror_hours = -1;
+static int mirror_baseline = 24;
+static int mount_rules = 0;
+static int smart_interval = -1;
+static volatile int dump_hists = 0;
+static histogram_t hists[H_MAX] = {
+  { "lag",     0, 0, 0, { 0 } },
+  { "parse",   0, 0, 0, { 0 } },
+  { "decide",  0, 0, 0, { 0 } },
+  { "actuate", 0, 0, 0, { 0 } },
+  { "log",     0, 0, 0, { 0 } }
+};
+static rrd_t *rrd;
+static FILE *trace_fp;
+static int trace_pid;
+static int trace_tids;
+static sysfs_attr_t *global_saved;
+static remount_t *remounts;
 static volatile int break_loop = 0;
+static cgroup_io_t *cg_io;
+static int cg_io_cnt;
+static int cg_io_max;
+static unsigned int cg_gen;
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_len;
 
 static void sighandler(int signo)
 {
-  (void) signo;
+  if (signo == SIGUSR1) {
+    dump_hists = 1;
+    return;
+  }
   break_loop = 1;
 }
 
@@ -175,16 +598,41 @@ int main(int argc, char *argv[])
 {
   idle_time_t *it_root;
   disk_stats_t *ds_root = NULL;
+  cgroup_t *cg_root = NULL;
   const char *logfile = "/dev/null";
+  const char *metrics_file = NULL;
+  const char *trace_file = NULL;
+  const char *rrd_file = NULL;
   idle_time_t *it;
   disk_stats_t *ds;
+  cgroup_t *cg;
   int have_logfile = 0;
   int min_idle_time;
   int sleep_time;
   int opt;
   int foreground = 0;
+  int estimate = 0;
+  int slack = 0;
+  time_t started;
+  unsigned long wakeups = 0;
+  unsigned long saved = 0;
+  int watchdog;
+  int unmount_grace = -1;
+  int mnt_fd = -1;
+  int mounts_changed = 1;
+  mount_t *mnt_root = NULL;
+  mirror_t *mirrors = NULL;
+  time_t mirror_next = 0;
+  int disks = -1;
+  int stopped = -1;
   int rc = 0;
   struct sigaction newact, oldact;
+  struct timespec ts_start;
+  long t_options;
+  long t_daemon = 0;
+  long t_poll;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
   /* Force line buffering for stdout, unbuffered for stderr */
   setvbuf(stdout, NULL, _IOLBF, 0);
@@ -198,16 +646,18 @@ int main(int argc, char *argv[])
   it->next = NULL;
   it->name = NULL;
   it->name_allocd = 0;
+  it->mount = 0;
   it->idle_time = DEFAULT_IDLE_TIME;
+  it->latency = -1;
   it_root = it;
 
   /* process command line options */
-  while ((opt = getopt(argc, argv, "t:a:i:l:fdh")) != -1) {
+  while ((opt = getopt(argc, argv, "t:a:i:AL:c:eEH:j:km:M:no:O:q:r:Ss:u:w:x:l:fdh")) != -1) {
     switch (opt) {
 
     case 't':
       /* just spin-down the specified disk and exit */
-      spindown_disk(optarg);
+      spindown_disk(optarg, find_quirk(optarg));
       _return(0);
       break;
 
@@ -217,11 +667,33 @@ int main(int argc, char *argv[])
         fprintf(stderr, "out of memory\n");
         _return(2);
       }
-      it->name = disk_name(optarg);
-      it->name_allocd = (it->name != optarg);
+      if ((it->name = mount_rule(optarg)) != NULL) {
+        /* mountpoint or filesystem UUID, resolved via the mount table */
+        it->mount = 1;
+        it->name_allocd = 1;
+        mount_rules = 1;
+      } else {
+        it->name = disk_name(optarg);
+        it->name_allocd = (it->name != optarg);
+        it->mount = 0;
+      }
       it->idle_time = DEFAULT_IDLE_TIME;
+      it->latency = -1;
       it->next = it_root;
       it_root = it;
+      if (*it->name == '@') {
+        profile_t *p;
+        for (p = profiles; p->name != NULL && strcmp(p->name, it->name + 1); p++);
+        if (p->name == NULL) {
+          fprintf(stderr, "error: unknown profile %s\n", it->name);
+          _return(1);
+        }
+      }
+      break;
+
+    case 'A':
+      /* use per-profile default idle times */
+      auto_profile = 1;
       break;
 
     case 'i':
@@ -229,6 +701,114 @@ int main(int argc, char *argv[])
       it->idle_time = atoi(optarg);
       break;
 
+    case 'L':
+      /* set the wake latency budget (ms) for current (or default) disk */
+      it->latency = atoi(optarg);
+      break;
+
+    case 'c':
+      /* ignore I/O issued by processes in this cgroup */
+      if ((cg = open_cgroup(optarg)) == NULL) {
+        _return(1);
+      }
+      cg->next = cg_root;
+      cg_root = cg;
+      break;
+
+    case 'e':
+      estimate = 1;
+      break;
+
+    case 'E':
+      /* disable the kernel's media change polling on managed disks */
+      no_events_poll = 1;
+      break;
+
+    case 'H':
+      /* just print the hour-of-week heatmaps of the history and exit */
+      _return(heat_dump(optarg) < 0);
+      break;
+
+    case 'j':
+      /* write a timeline of spin states and I/O rates to this file */
+      trace_file = optarg;
+      break;
+
+    case 'k':
+      /* let the kernel spin down disks via runtime PM where possible */
+      runtime_pm = 1;
+      break;
+
+    case 'm':
+      /* steer RAID1 reads to one member, rotating every <hours>, after
+       * counting spin-ups without steering for [:<baseline hours>]
+       */
+      mirror_hours = atoi(optarg);
+      if (strchr(optarg, ':') != NULL) {
+        mirror_baseline = atoi(strchr(optarg, ':') + 1);
+      }
+      break;
+
+    case 'M':
+      /* cache SMART data, collected while disks are awake anyway */
+      smart_interval = atoi(optarg);
+      break;
+
+    case 'n':
+      /* suppress atime updates on filesystems of stopped disks */
+      noatime = 1;
+      break;
+
+    case 'o':
+      /* keep a history of disk activity in this file */
+      rrd_file = optarg;
+      break;
+
+    case 'O':
+      /* just print the activity history and exit */
+      _return(rrd_dump(optarg) < 0);
+      break;
+
+    case 'q':
+      /* add a bridge/drive quirk: <vid>:<pid>[:<model>]=<flags> */
+      if (add_quirk(optarg) < 0) {
+        _return(1);
+      }
+      break;
+
+    case 'r':
+      /* boost read-ahead for streaming and stop disks between chunks */
+      stream_timeout = atoi(optarg);
+      break;
+
+    case 'S':
+      /* make sure real SCSI disks are restarted after being stopped */
+      scsi_restart = 1;
+      break;
+
+    case 's':
+      /* coalesce wakeups within this many seconds */
+      slack = atoi(optarg);
+      break;
+
+    case 'u':
+      /* spin down disks this many seconds after the last unmount */
+      unmount_grace = atoi(optarg);
+      break;
+
+    case 'w':
+      /* buffer writes to stopped disks for up to <age>[:<size in KiB>] */
+      wbuf_age = atoi(optarg);
+      if (strchr(optarg, ':') != NULL) {
+        wbuf_size = atol(strchr(optarg, ':') + 1);
+      }
+      break;
+
+    case 'x':
+      /* write timing histograms to this file after each poll */
+      metrics_file = optarg;
+      break;
+
     case 'l':
       logfile = optarg;
       have_logfile = 1;
@@ -243,7 +823,7 @@ int main(int argc, char *argv[])
       break;
 
     case 'h':
-      printf("usage: hd-idle [-t <disk>] [-a <name>] [-i <idle_time>] [-l <logfile>] [-f] [-d] [-h]\n");
+      printf("usage: hd-idle [-t <disk>] [-a <name>] [-i <idle_time>] [-A] [-L <ms>] [-c <cgroup>] [-e] [-E] [-H <history>] [-j <trace>] [-k] [-m <hours>[:<baseline>]] [-M <interval>] [-n] [-o <history>] [-O <history>] [-q <quirk>] [-r <timeout>] [-S] [-s <slack>] [-u <grace>] [-w <age>[:<size>]] [-x <metrics>] [-l <logfile>] [-f] [-d] [-h]\n");
       _return(0);
       break;
 
@@ -266,13 +846,24 @@ int main(int argc, char *argv[])
       min_idle_time = it->idle_time;
     }
   }
+  if (auto_profile) {
+    profile_t *p;
+    for (p = profiles; p->name != NULL; p++) {
+      if (p->idle_time != 0 && p->idle_time < min_idle_time) {
+        min_idle_time = p->idle_time;
+      }
+    }
+  }
   if ((sleep_time = min_idle_time / 10) == 0) {
     sleep_time = 1;
   }
 
+  t_options = elapsed_us(CLOCK_MONOTONIC, &ts_start);
+
   /* daemonize unless we're running in debug mode */
   if (!debug && !foreground) {
     daemonize();
+    t_daemon = elapsed_us(CLOCK_MONOTONIC, &ts_start) - t_options;
   }
 
   newact.sa_handler = sighandler;
@@ -288,30 +879,130 @@ int main(int argc, char *argv[])
   sigaction(SIGTERM, NULL, &oldact);
   if (oldact.sa_handler != SIG_IGN)
     sigaction(SIGTERM, &newact, NULL);
+  sigaction(SIGUSR1, &newact, NULL);
+
+  /* Let the kernel merge our timers with others. The kernel may delay a
+   * wakeup by its timer slack on top of the coalescing done by next_wakeup(),
+   * thus it only gets a tenth of the slack to keep the total bounded.
+   */
+  if (slack > 0) {
+    unsigned long ns = (unsigned long) -1;
+    if ((unsigned long) slack < ns / 100000000UL) {
+      ns = (unsigned long) slack * 100000000UL;
+    }
+    if (prctl(PR_SET_TIMERSLACK, ns, 0, 0, 0) < 0) {
+      perror("prctl(PR_SET_TIMERSLACK)");
+    }
+  }
+  started = time(NULL);
+
+  if (mirror_hours >= 0 && mirror_baseline > 0) {
+    /* count the spin-ups of RAID1 members without steering first */
+    fprintf(stderr, "RAID1 read steering starts in %d h, counting spin-ups "
+            "until then\n", mirror_baseline);
+    mirror_next = started + mirror_baseline * 3600L;
+  }
+
+  /* systemd readiness and watchdog notifications (if running under systemd) */
+  watchdog = notify_init();
+
+  /* undo atime and writeback changes left behind by a previous instance */
+  atime_replay();
+  wbuf_replay();
+
+  /* watch for mount table changes (POLLPRI) to catch unmounts and keep
+   * track of mounts for noatime remounts and mountpoint rules
+   */
+  if ((unmount_grace >= 0 || noatime || mount_rules) &&
+      (mnt_fd = open(MOUNT_FILE, O_RDONLY)) < 0) {
+    perror(MOUNT_FILE);
+    _return(2);
+  }
+
+  if (trace_file != NULL && trace_open(trace_file) < 0) {
+    _return(2);
+  }
+  if (rrd_file != NULL && rrd_open(rrd_file) < 0) {
+    _return(2);
+  }
 
   /* main loop: probe for idle disks and stop them */
   for (;;) {
     disk_stats_t tmp;
     FILE *fp;
     char buf[200];
+    time_t now;
+    time_t polled;
+    time_t wakeup;
+    time_t wait;
+    struct timespec ts_cpu;
+    long act_us = 0;
+    int n_act = 0;
+    int attached = 0;
+    int n_lines = 0;
+    long long t_mark;
+    long long t_ns;
+    long long parse_ns = 0;
+    long long decide_ns = 0;
+    long long *phase = &parse_ns;
+    long long planned;
 
     if (break_loop)
       break;
 
+    if (debug) {
+      clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts_cpu);
+    }
+    PROBE(poll_start);
+
+    t_mark = mono_ns();
     if ((fp = fopen(STAT_FILE, "r")) == NULL) {
       perror(STAT_FILE);
       _return(2);
     }
+    polled = time(NULL);
 
     memset(&tmp, 0x00, sizeof(tmp));
 
-    while (fgets(buf, sizeof(buf), fp) != NULL) {
-      if (sscanf(buf, "%*d %*d %s %*u %*u %u %*u %*u %*u %u %*u %*u %*u %*u",
-                 tmp.name, &tmp.reads, &tmp.writes) == 3) {
-        time_t now = time(NULL);
+    /* sample the I/O counters of ignored cgroups before the disk counters so
+     * any I/O they issue between the two reads is counted as foreign I/O
+     * rather than hiding somebody else's
+     */
+    if (cg_root != NULL) {
+      read_cgroups(cg_root);
+    }
+
+    for (;;) {
+      /* account the time since the last mark to parsing or deciding; this
+       * is done here because of the many 'continue' statements below
+       */
+      t_ns = mono_ns();
+      *phase += t_ns - t_mark;
+      t_mark = t_ns;
+      phase = &parse_ns;
+
+      if (fgets(buf, sizeof(buf), fp) == NULL) {
+        break;
+      }
+      if (sscanf(buf, "%u %u %s %u %u %u %*u %u %*u %u %*u %u %u %u",
+                 &tmp.major, &tmp.minor, tmp.name, &tmp.reads, &tmp.read_merges,
+                 &tmp.read_sectors, &tmp.writes, &tmp.write_sectors, &tmp.in_flight,
+                 &tmp.io_ticks, &tmp.in_queue) == 11) {
+        cgroup_io_t *cio;
+
+        now = time(NULL);
 
-        if (!is_scsi_disk(tmp.name))
+        if (!is_scsi_disk(tmp.major, tmp.minor))
           continue;
+        n_lines++;
+
+        if ((cio = get_cgroup_io(tmp.major, tmp.minor)) != NULL) {
+          tmp.cg_reads = cio->rios;
+          tmp.cg_writes = cio->wios;
+        } else {
+          tmp.cg_reads = 0;
+          tmp.cg_writes = 0;
+        }
 
         dprintf("probing %s: reads: %u, writes: %u\n", tmp.name, tmp.reads, tmp.writes);
 
@@ -325,55 +1016,429 @@ int main(int argc, char *argv[])
             _return(2);
           }
           memcpy(ds, &tmp, sizeof(*ds));
+          ds->cg_gen = cg_gen;
           ds->last_io = now;
+          ds->last_poll = now;
           ds->spinup = ds->last_io;
           ds->next = ds_root;
           ds_root = ds;
+        }
+        ds->seen = 1;
+
+        t_ns = mono_ns();
+        parse_ns += t_ns - t_mark;
+        t_mark = t_ns;
+        phase = &decide_ns;
 
-          /* find idle time for this disk (falling-back to default; default means
-           * 'it->name == NULL' and this entry will always be the last due to the
-           * way this single-linked list is built when parsing command line
-           * arguments)
+        if (ds->mpath != NULL) {
+          /* one of several paths to the same disk; the disk is handled once
+           * the counters of all paths have been read
            */
-          for (it = it_root; it != NULL; it = it->next) {
-            if (it->name == NULL || !strcmp(ds->name, it->name)) {
-              ds->idle_time = it->idle_time;
-              break;
-            }
+          if (mpath_collect(ds, &tmp) < 0) {
+            continue;
           }
+          ds = ds->mpath;
+        }
+
+        if (!ds->probed) {
+          /* new disk, will be probed after this poll (see below) */
 
         } else if (ds->reads == tmp.reads && ds->writes == tmp.writes) {
-          if (!ds->spun_down) {
+          rrd_update(ds, 0, 0, now);
+          if (!ds->spun_down && ds->rpm) {
+            /* the kernel spins down this disk; check whether it did so in
+             * time, otherwise take over
+             */
+            if (now - ds->last_io >= ds->idle_time) {
+              char state[32];
+              if (sysfs_read(state, sizeof(state), "%s/%s/device/power/runtime_status",
+                             SYSFS_BLOCK, ds->name) == 0 && !strcmp(state, "suspended")) {
+                dprintf("%s: suspended by runtime PM\n", ds->name);
+                trace_stop(ds, 0, 0);
+                if (noatime) {
+                  atime_suppress(ds, mnt_root);
+                }
+                if (wbuf_age >= 0) {
+                  wbuf_start(ds, now);
+                }
+                ds->spindown = now;
+                ds->spun_down = 1;
+                ds->pstate = PS_STANDBY;
+              } else if (now - ds->last_io >= ds->idle_time + sleep_time) {
+                fprintf(stderr, "%s: runtime PM did not engage, falling back\n",
+                        ds->name);
+                sysfs_restore(&ds->rpm_saved);
+                ds->rpm = 0;
+              }
+            }
+          }
+          if (!ds->spun_down && !ds->rpm) {
             /* no activity on this disk and still running */
-            if (ds->idle_time != 0 && now - ds->last_io >= ds->idle_time) {
-              spindown_disk(ds->name);
-              ds->spindown = now;
-              ds->spun_down = 1;
+            time_t deadline = disk_deadline(ds);
+            if (deadline != 0 && now >= deadline) {
+              int ps = -1;
+
+              if (!ds->restart_ok && check_restart(ds) < 0) {
+                fprintf(stderr, "%s: restart can't be guaranteed, "
+                        "not spinning down\n", ds->name);
+                ds->idle_time = 0;
+              } else if ((ps = pick_pstate(ds)) < 0) {
+                /* the budget is a hard limit; check again next poll */
+                if (!ds->no_pstate) {
+                  fprintf(stderr, "%s: no power state wakes up within %d ms, "
+                          "not spinning down\n", ds->name, ds->latency);
+                  ds->no_pstate = 1;
+                }
+                ds->retry_at = now + sleep_time;
+              } else {
+                int rc_stop = SG_REJECTED;
+
+                ds->no_pstate = 0;
+                PROBE1(spindown_issue, ds->name);
+                t_ns = mono_ns();
+                /* if the disk rejects an idle state as invalid, don't use it
+                 * again and retry with the next one right away; other errors
+                 * may be transient and are retried after a poll interval
+                 */
+                while (ps != PS_STANDBY &&
+                       (rc_stop = idle_disk(mpath_name(ds), ps, ds->quirk)) == SG_REJECTED) {
+                  dprintf("%s: %s rejected\n", ds->name, ps_names[ps]);
+                  ds->exit_ms[ps] = -1;
+                  if ((ps = pick_pstate(ds)) < 0) {
+                    break;
+                  }
+                }
+                if (ps == PS_STANDBY) {
+                  rc_stop = spindown_disk(mpath_name(ds), ds->quirk);
+                }
+                t_ns = mono_ns() - t_ns;
+                PROBE3(spindown_done, ds->name, rc_stop, (long) (t_ns / 1000));
+                hist_add(&hists[H_ACTUATE], t_ns / 1000);
+                decide_ns -= t_ns;
+                act_us += (long) (t_ns / 1000);
+                n_act++;
+                if (rc_stop != 0) {
+                  /* still running as far as we know; don't retry before the
+                   * next regular poll
+                   */
+                  fprintf(stderr, "%s: spin-down failed, retrying in %d s\n",
+                          ds->name, sleep_time);
+                  ds->retry_at = now + sleep_time;
+                } else {
+                  trace_stop(ds, t_ns / 1000, rc_stop);
+                  if (noatime) {
+                    atime_suppress(ds, mnt_root);
+                  }
+                  if (wbuf_age >= 0) {
+                    wbuf_start(ds, now);
+                  }
+                  ds->spindown = now;
+                  ds->spun_down = 1;
+                  ds->pstate = (unsigned int) ps;
+                  ds->stop_at = 0;
+                  ds->retry_at = 0;
+                }
+              }
+            }
+          }
+          if (ds->streaming && now - ds->last_io >= ds->idle_time) {
+            /* no more chunks within the regular idle time */
+            stream_end(ds);
+          }
+          if (ds->spun_down && wbuf_age >= 0) {
+            /* flush buffered writes when they reach the maximum age; if the
+             * disk stays asleep, there was nothing to write, thus buffering
+             * can be resumed
+             */
+            if (ds->wbuf && now - ds->wbuf_since >= wbuf_age) {
+              dprintf("%s: flushing buffered writes\n", ds->name);
+              wbuf_end(ds);
+              ds->wbuf_since = now;
+            } else if (!ds->wbuf && now - ds->wbuf_since >= WBUF_SETTLE) {
+              wbuf_start(ds, now);
             }
           }
+          trace_io(ds, 0, 0, now - ds->last_poll);
+          ds->io_ticks = tmp.io_ticks;
+          ds->in_queue = tmp.in_queue;
+          ds->last_poll = now;
 
         } else {
-          /* disk had some activity */
+          /* disk had some activity; the I/O counters of ignored cgroups count
+           * bios before merging so they may exceed the disk's share, hence
+           * only a positive remainder is considered to be foreign I/O
+           */
+          unsigned int ios = (tmp.reads - ds->reads) + (tmp.writes - ds->writes);
+          unsigned int ign = (tmp.cg_reads - ds->cg_reads) +
+                             (tmp.cg_writes - ds->cg_writes);
+
+          if (ds->cg_gen != cg_gen) {
+            /* an ignored cgroup has come or gone since the last activity,
+             * thus the counters aren't comparable; start over from here
+             */
+            ign = 0;
+            ds->cg_gen = cg_gen;
+          }
+
+          PROBE3(activity, ds->name, tmp.reads - ds->reads,
+                 tmp.writes - ds->writes);
+          rrd_update(ds, tmp.reads - ds->reads + tmp.writes - ds->writes,
+                     tmp.read_sectors - ds->read_sectors +
+                     tmp.write_sectors - ds->write_sectors, now);
+
           if (ds->spun_down) {
             /* disk was spun down, thus it has just spun up */
+            PROBE2(spinup, ds->name, (long) (now - ds->spindown));
+            trace_wake(ds);
+            learn_pstate(ds, tmp.io_ticks - ds->io_ticks, now - ds->last_poll);
+            if (noatime) {
+              atime_restore(ds->name);
+            }
+            if (ds->wbuf) {
+              wbuf_end(ds);
+            }
             if (have_logfile) {
+              t_ns = mono_ns();
               log_spinup(logfile, ds);
+              t_ns = mono_ns() - t_ns;
+              hist_add(&hists[H_LOG], t_ns / 1000);
+              decide_ns -= t_ns;
             }
             ds->spinup = now;
+            ds->spinups++;
+          }
+          trace_io(ds, tmp.reads - ds->reads, tmp.writes - ds->writes,
+                   now - ds->last_poll);
+          if (ds->stop_at != 0 && now >= ds->stop_at + UNMOUNT_SETTLE) {
+            /* still in use after unmounting; back to normal idle time */
+            ds->stop_at = 0;
+          }
+          if (ios > ign) {
+            ds->last_io = (estimate) ? estimate_last_io(ds, &tmp, now) : now;
+          } else {
+            /* the disk is still busy, thus don't stop it before it has been
+             * quiet for a whole poll interval
+             */
+            dprintf("%s: ignoring %u I/Os from excluded cgroups\n", ds->name, ios);
+            ds->retry_at = now + sleep_time;
+          }
+          if (stream_timeout >= 0) {
+            stream_check(ds, &tmp, now);
+          }
+          if (smart_interval >= 0 && ds->probed &&
+              (ds->smart_at == 0 || now - ds->smart_at >= smart_interval)) {
+            /* the disk has just served I/O, thus it's spinning */
+            smart_collect(ds, now);
           }
           ds->reads = tmp.reads;
           ds->writes = tmp.writes;
-          ds->last_io = now;
+          ds->read_merges = tmp.read_merges;
+          ds->read_sectors = tmp.read_sectors;
+          ds->write_sectors = tmp.write_sectors;
+          ds->cg_reads = tmp.cg_reads;
+          ds->cg_writes = tmp.cg_writes;
+          ds->io_ticks = tmp.io_ticks;
+          ds->in_queue = tmp.in_queue;
+          ds->last_poll = now;
           ds->spun_down = 0;
         }
       }
     }
 
     fclose(fp);
+    PROBE2(poll_end, n_lines, n_act);
+    hist_add(&hists[H_PARSE], parse_ns / 1000);
+    hist_add(&hists[H_DECIDE], decide_ns / 1000);
+
+    /* CPU time of the poll (excluding probing) and time spent stopping disks,
+     * i.e. how hd-idle scales with the number of disks
+     */
+    if (debug) {
+      dprintf("poll: %d disk(s), %ld us CPU, %d spin-down(s) in %ld us\n",
+              n_lines, elapsed_us(CLOCK_PROCESS_CPUTIME_ID, &ts_cpu), n_act, act_us);
+    }
+
+    /* Probe new disks only after the poll to keep startup fast; a new disk
+     * won't be spun down before the next poll, anyway. Disks which have
+     * disappeared are removed.
+     */
+    t_poll = elapsed_us(CLOCK_MONOTONIC, &ts_start);
+    {
+      disk_stats_t **dsp = &ds_root;
+      while ((ds = *dsp) != NULL) {
+        if (!ds->seen) {
+          dprintf("%s: removed\n", ds->name);
+          if (ds->mpath != NULL) {
+            /* the remaining paths are probed again as separate disks */
+            mpath_split(ds->mpath, ds);
+          }
+          *dsp = ds->next;
+          trace_end(ds);
+          detach_disk(ds);
+          free(ds);
+          continue;
+        }
+        if (!ds->probed) {
+          attach_disk(ds, ds_root, it_root);
+          if (ds->mpath == NULL || ds->mpath == ds) {
+            trace_start(ds);
+            rrd_attach(ds);
+          }
+          attached = 1;
+        }
+        ds->seen = 0;
+        ds->pending = 0;
+        dsp = &ds->next;
+      }
+    }
+    if (t_options >= 0) {
+      dprintf("startup: options %ld us, daemonize %ld us, first poll %ld us, "
+              "probing %ld us\n", t_options, t_daemon,
+              t_poll - t_options - t_daemon,
+              elapsed_us(CLOCK_MONOTONIC, &ts_start) - t_poll);
+      t_options = -1;
+      notify("READY=1");
+    }
+
+    /* RAID1 read steering: (re)scan arrays and rotate primary members */
+    now = time(NULL);
+    if (mirror_hours >= 0 && mirror_next >= 0 && now >= mirror_next) {
+      mirrors = mirror_rotate(mirrors, ds_root, started);
+      mirror_next = (mirror_hours > 0) ? now + mirror_hours * 3600L : (time_t) -1;
+    }
+
+    /* Check the mount table after the poll so the I/O caused by unmounting
+     * has already been accounted for. Disks which lost their last mount and
+     * aren't used otherwise (holders) are spun down after the grace period.
+     */
+    if (mnt_fd >= 0 && mounts_changed) {
+      dprintf("reading mount table\n");
+      mounts_changed = 0;
+      free_mounts(mnt_root);
+      mnt_root = read_mounts(mnt_fd);
+      if (mount_rules) {
+        resolve_rules(it_root, mnt_root, ds_root);
+        attached = 0;
+      }
+      if (unmount_grace >= 0) {
+        for (ds = ds_root; ds != NULL; ds = ds->next) {
+          ds->was_mounted = (ds->mounts > 0);
+        }
+        count_mounts(mnt_root, ds_root);
+        now = time(NULL);
+        for (ds = ds_root; ds != NULL; ds = ds->next) {
+          if (ds->mounts > 0) {
+            ds->stop_at = 0;
+          } else if (ds->was_mounted && !ds->spun_down && ds->idle_time != 0 &&
+                     !has_holders(ds->name)) {
+            dprintf("%s: last filesystem unmounted\n", ds->name);
+            ds->stop_at = now + unmount_grace;
+          }
+        }
+      }
+    }
+
+    /* UUID rules apply to unmounted disks as well, thus new disks need to
+     * be matched even if the mount table hasn't changed
+     */
+    if (attached && mount_rules) {
+      resolve_rules(it_root, mnt_root, ds_root);
+    }
+
+    /* the loop made progress; tell systemd and update the status line */
+    if (notify_fd >= 0) {
+      int n = 0;
+      int n_stopped = 0;
+      for (ds = ds_root; ds != NULL; ds = ds->next) {
+        if (ds->mpath != NULL && ds->mpath != ds) {
+          continue;
+        }
+        n++;
+        n_stopped += ds->spun_down;
+      }
+      if (n != disks || n_stopped != stopped) {
+        notify("STATUS=%d disk(s), %d spun down", n, n_stopped);
+        disks = n;
+        stopped = n_stopped;
+      }
+      if (watchdog > 0) {
+        notify("WATCHDOG=1");
+      }
+    }
+
+    if (dump_hists) {
+      dump_hists = 0;
+      hist_dump(stderr);
+    }
+    if (metrics_file != NULL) {
+      hist_metrics(metrics_file);
+    }
+    if (trace_fp != NULL) {
+      fflush(trace_fp);
+    }
 
     if (break_loop)
       break;
-    sleep(sleep_time);
+
+    /* sleep until the next regular poll or until the next disk is due to be
+     * spun down, whichever comes first (modulo coalescing)
+     */
+    now = time(NULL);
+    {
+      int merged;
+      wakeup = next_wakeup(ds_root, polled, now + sleep_time, slack, &merged);
+      if (merged > 0) {
+        dprintf("coalescing %d wakeup(s) into one at +%ld s\n", merged,
+                (long) (wakeup - now));
+        saved += merged;
+      }
+    }
+    if (watchdog > 0 && wakeup > now + watchdog) {
+      wakeup = now + watchdog;
+    }
+    wakeups++;
+
+    /* the wait may be huge (e.g. if no disk is ever spun down), thus limit
+     * it to what poll() can handle; waking up early is harmless
+     */
+    wait = (wakeup > now) ? wakeup - now : 1;
+    if (wait > INT_MAX / 1000) {
+      wait = INT_MAX / 1000;
+    }
+
+    /* Record how late we wake up compared to the plan, which shows whether
+     * spin-downs are late because of CPU starvation or timer slack; early
+     * wakeups (signals, mount table changes) are not recorded.
+     */
+    planned = mono_ns() + (long long) wait * 1000000000LL;
+    if (mnt_fd >= 0) {
+      struct pollfd pfd;
+      int n;
+      pfd.fd = mnt_fd;
+      pfd.events = POLLPRI;
+      pfd.revents = 0;
+      n = poll(&pfd, 1, (int) wait * 1000);
+      if (n > 0 && (pfd.revents & (POLLPRI | POLLERR)) != 0) {
+        mounts_changed = 1;
+      }
+      if (n == 0) {
+        hist_add(&hists[H_LAG], (mono_ns() - planned) / 1000);
+      }
+    } else if (sleep((unsigned int) wait) == 0) {
+      hist_add(&hists[H_LAG], (mono_ns() - planned) / 1000);
+    }
+  }
+
+  notify("STOPPING=1");
+
+  if (debug) {
+    hist_dump(stdout);
+  }
+
+  if (slack > 0) {
+    long hours = (long) (time(NULL) - started) / 3600;
+    dprintf("wakeups: %lu, saved by coalescing: %lu (%lu per hour)\n",
+            wakeups, saved, (hours > 0) ? saved / hours : saved);
   }
 
 out:
@@ -381,6 +1446,8 @@ out:
     /* To avoid use-after-free */
     disk_stats_t *dsnext;
     idle_time_t  *itnext;
+    cgroup_t     *cgnext;
+    quirk_t      *q;
 
     for (it = it_root; it != NULL; it = itnext) {
       itnext = it->next;
@@ -389,254 +1456,3039 @@ out:
       free(it);
     }
 
+    mirror_restore(mirrors, ds_root);
+    trace_close(ds_root);
+    rrd_close();
+
+    while ((q = user_quirks) != NULL) {
+      user_quirks = q->next;
+      free((char *) q->model);
+      free(q);
+    }
+
     for (ds = ds_root; ds != NULL; ds = dsnext) {
       dsnext = ds->next;
+      detach_disk(ds);
       free(ds);
     }
+
+    for (cg = cg_root; cg != NULL; cg = cgnext) {
+      cgnext = cg->next;
+      if (cg->fd >= 0)
+        close(cg->fd);
+      free(cg->path);
+      free(cg);
+    }
+    free(cg_io);
+
+    if (notify_fd >= 0)
+      close(notify_fd);
+    if (mnt_fd >= 0)
+      close(mnt_fd);
+    free_mounts(mnt_root);
+    atime_restore(NULL);
+    if (global_saved != NULL) {
+      sysfs_restore(&global_saved);
+      wbuf_journal(NULL);
+    }
   }
 
   return(rc);
 }
 
-/* become a daemon */
-static void daemonize(void)
+/* Probe a new disk and set its parameters; this is called once per disk */
+static void attach_disk(disk_stats_t *ds, disk_stats_t *ds_root,
+                        idle_time_t *it_root)
 {
-  int maxfd;
-  int i;
-
-  /* fork #1: exit parent process and continue in the background */
-  if ((i = fork()) < 0) {
-    perror("couldn't fork");
-    exit(2);
-  } else if (i > 0) {
-    _exit(0);
+  if (mpath_merge(ds, ds_root) == 0) {
+    return;
   }
 
-  /* fork #2: detach from terminal and fork again so we can never regain
-   * access to the terminal */
-  setsid();
-  if ((i = fork()) < 0) {
-    perror("couldn't fork #2");
-    exit(2);
-  } else if (i > 0) {
-    _exit(0);
+  ds->transport = disk_transport(ds->name);
+  ds->profile = disk_profile(ds->name, ds->transport);
+  ds->quirk = find_quirk(ds->name);
+  ds->idle_time = find_idle_time(it_root, ds, &ds->latency);
+  memcpy(ds->exit_ms, ps_exit_ms, sizeof(ds->exit_ms));
+  ds->probed = 1;
+
+  dprintf("%s: transport %s, profile %s, idle time %d\n", ds->name,
+          ds->transport, (ds->profile != NULL) ? ds->profile : "none",
+          ds->idle_time);
+  if (ds->latency >= 0) {
+    dprintf("%s: wake latency budget %d ms\n", ds->name, ds->latency);
   }
 
-  /* change to root directory and close file descriptors */
-  chdir("/");
-  maxfd = getdtablesize();
-  for (i = 0; i < maxfd; i++) {
-    close(i);
+  /* runtime PM always means standby, thus not with a latency budget */
+  if (runtime_pm && ds->idle_time != 0 && ds->latency < 0) {
+    ds->rpm = (runtime_pm_setup(ds) == 0);
   }
+  events_poll_setup(ds);
+}
 
-  /* use /dev/null for stdin, stdout and stderr */
-  open("/dev/null", O_RDONLY);
-  open("/dev/null", O_WRONLY);
-  open("/dev/null", O_WRONLY);
+/* Release a disk's resources and restore any settings changed on attach */
+static void detach_disk(disk_stats_t *ds)
+{
+  if (ds->wbuf) {
+    wbuf_end(ds);
+  }
+  sysfs_restore(&ds->saved);
+  sysfs_restore(&ds->rpm_saved);
+  free(ds->io);
+  ds->io = NULL;
 }
 
-/* get DISKSTATS entry by name of disk */
-static disk_stats_t *get_diskstats(disk_stats_t *ds, const char *name)
+/* Merge a new disk into a known one if both are paths to the same physical
+ * disk (e.g. a dual-ported SAS disk with dm-multipath), as identified by the
+ * WWN. The known disk becomes the logical disk: its counters are the sums of
+ * all paths (see mpath_collect()) and it's the only one being spun down. The
+ * per-path counters are kept in 'io'. Returns 0 if the disk was merged.
+ */
+static int mpath_merge(disk_stats_t *ds, disk_stats_t *ds_root)
 {
-  for (; ds != NULL; ds = ds->next) {
-    if (!strcmp(ds->name, name)) {
-      return(ds);
+  char wwid[100];
+  char buf[100];
+  disk_stats_t *lg;
+
+  if (sysfs_read(wwid, sizeof(wwid), "%s/%s/device/wwid", SYSFS_BLOCK, ds->name) < 0 ||
+      *wwid == '\0') {
+    return(-1);
+  }
+  for (lg = ds_root; lg != NULL; lg = lg->next) {
+    if (lg != ds && lg->probed && (lg->mpath == NULL || lg->mpath == lg) &&
+        sysfs_read(buf, sizeof(buf), "%s/%s/device/wwid", SYSFS_BLOCK, lg->name) == 0 &&
+        !strcmp(buf, wwid)) {
+      break;
     }
   }
+  if (lg == NULL) {
+    return(-1);
+  }
 
-  return(NULL);
+  if ((ds->io = malloc(sizeof(*ds->io))) == NULL ||
+      (lg->mpath == NULL && (lg->io = malloc(sizeof(*lg->io))) == NULL)) {
+    fprintf(stderr, "out of memory\n");
+    free(ds->io);
+    ds->io = NULL;
+    return(-1);
+  }
+
+  if (lg->mpath == NULL) {
+    path_io_save(lg->io, lg);
+    lg->mpath = lg;
+    lg->paths = 1;
+    if (lg->rpm) {
+      /* runtime PM works per path, thus can't be used for the disk */
+      sysfs_restore(&lg->rpm_saved);
+      lg->rpm = 0;
+    }
+  }
+  path_io_save(ds->io, ds);
+  path_io_add(lg, ds->io);
+  ds->mpath = lg;
+  ds->next_path = lg->next_path;
+  lg->next_path = ds;
+  lg->paths++;
+  ds->probed = 1;
+  ds->idle_time = 0;
+
+  dprintf("%s: another path to %s (%s)\n", ds->name, lg->name, wwid);
+  return(0);
 }
 
-/* spin-down a disk */
-static void spindown_disk(const char *name)
+/* Record the counters of one path to a multipath disk; once all paths have
+ * been read in the current poll, 'tmp' is set to the sums and 0 is returned
+ */
+static int mpath_collect(disk_stats_t *ds, disk_stats_t *tmp)
 {
-  struct sg_io_hdr io_hdr;
-  unsigned char sense_buf[255];
-  char dev_name[100];
-  int fd;
+  disk_stats_t *lg = ds->mpath;
+  disk_stats_t *p;
 
-  dprintf("spindown: %s\n", name);
+  path_io_save(ds->io, tmp);
+  if (++lg->pending < lg->paths) {
+    return(-1);
+  }
+  lg->pending = 0;
 
-  /* fabricate SCSI IO request */
-  memset(&io_hdr, 0x00, sizeof(io_hdr));
-  io_hdr.interface_id = 'S';
-  io_hdr.dxfer_direction = SG_DXFER_NONE;
+  tmp->reads = tmp->writes = tmp->read_merges = tmp->read_sectors = 0;
+  tmp->write_sectors = 0;
+  tmp->in_flight = tmp->io_ticks = tmp->in_queue = 0;
+  tmp->cg_reads = tmp->cg_writes = 0;
+  for (p = lg; p != NULL; p = p->next_path) {
+    path_io_add(tmp, p->io);
+  }
+  return(0);
+}
 
-  /* SCSI stop unit command */
-  io_hdr.cmdp = (unsigned char *) "\x1b\x00\x00\x00\x00\x00";
+/* Dissolve a multipath disk after one of its paths ('gone') disappeared; the
+ * remaining paths get their own counters back (the logical disk's are the
+ * sums of all paths) and are probed again (and merged again) as new disks
+ */
+static void mpath_split(disk_stats_t *lg, disk_stats_t *gone)
+{
+  disk_stats_t *p;
+  disk_stats_t *next;
 
-  io_hdr.cmd_len = 6;
-  io_hdr.sbp = sense_buf;
-  io_hdr.mx_sb_len = (unsigned char) sizeof(sense_buf);
+  for (p = lg; p != NULL; p = next) {
+    next = p->next_path;
+    if (p != gone) {
+      if (p->io != NULL) {
+        path_io_load(p, p->io);
+      }
+      detach_disk(p);
+      p->probed = 0;
+      p->spun_down = 0;
+    }
+    p->mpath = NULL;
+    p->next_path = NULL;
+    p->paths = 0;
+    p->pending = 0;
+  }
+}
 
-  /* open disk device (kernel 2.4 will probably need "sg" names here) */
-  snprintf(dev_name, sizeof(dev_name), "/dev/%s", name);
-  if ((fd = open(dev_name, O_RDONLY)) < 0) {
-    perror(dev_name);
+/* Get the name of a healthy path to a disk for sending commands */
+static const char *mpath_name(disk_stats_t *ds)
+{
+  disk_stats_t *p;
+  char state[32];
+
+  for (p = ds->mpath; p != NULL; p = p->next_path) {
+    if (sysfs_read(state, sizeof(state), "%s/%s/device/state", SYSFS_BLOCK,
+                   p->name) == 0 && !strcmp(state, "running")) {
+      return(p->name);
+    }
+  }
+  return(ds->name);
+}
+
+/* save the counters of a path */
+static void path_io_save(path_io_t *io, const disk_stats_t *src)
+{
+  io->reads = src->reads;
+  io->writes = src->writes;
+  io->read_merges = src->read_merges;
+  io->read_sectors = src->read_sectors;
+  io->write_sectors = src->write_sectors;
+  io->in_flight = src->in_flight;
+  io->io_ticks = src->io_ticks;
+  io->in_queue = src->in_queue;
+  io->cg_reads = src->cg_reads;
+  io->cg_writes = src->cg_writes;
+}
+
+/* add the counters of a path to those of a disk */
+static void path_io_add(disk_stats_t *dst, const path_io_t *io)
+{
+  dst->reads += io->reads;
+  dst->writes += io->writes;
+  dst->read_merges += io->read_merges;
+  dst->read_sectors += io->read_sectors;
+  dst->write_sectors += io->write_sectors;
+  dst->in_flight += io->in_flight;
+  dst->io_ticks += io->io_ticks;
+  dst->in_queue += io->in_queue;
+  dst->cg_reads += io->cg_reads;
+  dst->cg_writes += io->cg_writes;
+}
+
+/* set the counters of a disk to those of a path */
+static void path_io_load(disk_stats_t *dst, const path_io_t *io)
+{
+  dst->reads = io->reads;
+  dst->writes = io->writes;
+  dst->read_merges = io->read_merges;
+  dst->read_sectors = io->read_sectors;
+  dst->write_sectors = io->write_sectors;
+  dst->in_flight = io->in_flight;
+  dst->io_ticks = io->io_ticks;
+  dst->in_queue = io->in_queue;
+  dst->cg_reads = io->cg_reads;
+  dst->cg_writes = io->cg_writes;
+}
+
+/* Report (and optionally disable) the block layer's media change polling of a
+ * disk. For disks with removable media, the kernel periodically issues TEST
+ * UNIT READY or similar commands which may keep USB bridges awake or even
+ * spin up the disk. 'events' lists the events a disk supports (if empty,
+ * there's no polling) and 'events_poll_msecs' is the interval with -1
+ * meaning the system default.
+ */
+static void events_poll_setup(disk_stats_t *ds)
+{
+  char events[100];
+  char buf[20];
+  long msecs;
+
+  if (sysfs_read(events, sizeof(events), "%s/%s/events", SYSFS_BLOCK, ds->name) < 0 ||
+      *events == '\0' ||
+      sysfs_read(buf, sizeof(buf), "%s/%s/events_poll_msecs", SYSFS_BLOCK, ds->name) < 0) {
+    return;
+  }
+  if ((msecs = atol(buf)) < 0) {
+    if (sysfs_read(buf, sizeof(buf), "/sys/module/block/parameters/events_dfl_poll_msecs") < 0) {
+      return;
+    }
+    msecs = atol(buf);
+  }
+  if (msecs == 0) {
     return;
   }
 
-  /* execute SCSI request */
-  if (ioctl(fd, SG_IO, &io_hdr) < 0) {
-    char buf[100];
-    snprintf(buf, sizeof(buf), "ioctl on %s:", name);
-    perror(buf);
+  if (!no_events_poll || ds->idle_time == 0) {
+    dprintf("%s: media change polling enabled (%s) every %ld ms\n", ds->name,
+            events, msecs);
+    return;
+  }
+  if (sysfs_set(&ds->saved, "0", "%s/%s/events_poll_msecs", SYSFS_BLOCK, ds->name) < 0) {
+    fprintf(stderr, "%s: can't disable media change polling\n", ds->name);
+  } else {
+    /* a system-visible change, thus logged without -d, too */
+    fprintf(stderr, "%s: media change polling (%s) disabled, was every %ld ms\n",
+            ds->name, events, msecs);
+  }
+}
 
-  } else if (io_hdr.masked_status != 0) {
-    fprintf(stderr, "error: SCSI command failed with status 0x%02x\n",
-            io_hdr.masked_status);
-    if (io_hdr.masked_status == CHECK_CONDITION) {
-      phex(stderr, sense_buf, io_hdr.sb_len_wr, "sense buffer:\n");
+/* Detect low-rate streaming (e.g. media playback) which would otherwise keep a
+ * disk spinning for hours: reads only, below STREAM_MAX_RATE and sequential
+ * (large or merged requests) for STREAM_POLLS consecutive polls with
+ * activity. While streaming, the disk's read-ahead is raised so data is read
+ * in large chunks and the disk is stopped between chunks after the short
+ * 'stream_timeout'. Note that the kernel sizes the read-ahead window of a
+ * file when it's opened, thus files already open only benefit after being
+ * re-opened.
+ */
+static void stream_check(disk_stats_t *ds, disk_stats_t *tmp, time_t now)
+{
+  unsigned int reads = tmp->reads - ds->reads;
+  unsigned int merges = tmp->read_merges - ds->read_merges;
+  unsigned int sectors = tmp->read_sectors - ds->read_sectors;
+  long interval = (long) (now - ds->last_poll);
+  int match;
+
+  if (interval <= 0) {
+    return;
+  }
+
+  match = (tmp->writes == ds->writes && reads > 0 &&
+           sectors / 2 / interval < STREAM_MAX_RATE &&
+           (sectors / reads >= 128 || merges * 2 >= reads));
+
+  if (!match) {
+    ds->stream_polls = 0;
+    if (ds->streaming) {
+      stream_end(ds);
     }
+  } else if (++ds->stream_polls >= STREAM_POLLS && !ds->streaming) {
+    dprintf("%s: streaming at %u KiB/s\n", ds->name,
+            (unsigned int) (sectors / 2 / interval));
+    sysfs_set(&ds->saved, STREAM_READ_AHEAD, "%s/%s/queue/read_ahead_kb",
+              SYSFS_BLOCK, ds->name);
+    ds->streaming = 1;
   }
+}
 
-  close(fd);
+/* end streaming mode and restore the disk's read-ahead */
+static void stream_end(disk_stats_t *ds)
+{
+  dprintf("%s: streaming ended\n", ds->name);
+  sysfs_unset(&ds->saved, "%s/%s/queue/read_ahead_kb", SYSFS_BLOCK, ds->name);
+  ds->streaming = 0;
+  ds->stream_polls = 0;
 }
 
-/* write a spin-up event message to the log file */
-static void log_spinup(const char *logfile, disk_stats_t *ds)
+/* Collect SMART data of a disk which is known to be spinning (i.e. it has just
+ * served I/O) and publish it in SMART_FILE<disk>, so monitoring tools don't
+ * have to wake up sleeping disks. ATA disks (libata) and USB bridges known to
+ * support it (see ata_pt_safe()) are queried with SMART READ DATA via ATA
+ * PASS-THROUGH, real SCSI disks with the temperature log page. Other USB
+ * bridges are skipped since some of them crash on pass-through commands. The
+ * result is written to a temporary file and renamed, thus readers always see
+ * a complete entry.
+ */
+static void smart_collect(disk_stats_t *ds, time_t now)
 {
+  unsigned char data[512];
+  unsigned char cdb[16];
+  char path[sizeof(SMART_FILE) + 60];
+  char tmp[sizeof(path) + 4];
+  const char *name = mpath_name(ds);
+  int temp = -1;
+  int ata;
   FILE *fp;
+  int i;
 
-  if ((fp = fopen(logfile, "a")) != NULL) {
-    setvbuf(fp, NULL, _IOLBF, 0); /* line buffer */
-    /* Print statistics to logfile
-     *
-     * Note: This doesn't work too well if there are multiple disks
-     *       because the I/O we're dealing with might be on another
-     *       disk so we effectively wake up the disk the log file is
-     *       stored on as well. Then again the logfile is a debugging
-     *       option, so what...
-     */
-    time_t now = time(NULL);
-    char tstr[20];
-    char dstr[20];
+  /* failures are retried at the next interval, too */
+  ds->smart_at = now;
+  memset(cdb, 0x00, sizeof(cdb));
+  memset(data, 0x00, sizeof(data));
 
-    strftime(dstr, sizeof(dstr), "%Y-%m-%d", localtime(&now));
-    strftime(tstr, sizeof(tstr), "%H:%M:%S", localtime(&now));
-    fprintf(fp,
-            "date: %s, time: %s, disk: %s, running: %ld, stopped: %ld\n",
-            dstr, tstr, ds->name,
-            (long) ds->spindown - (long) ds->spinup,
-            (long) time(NULL) - (long) ds->spindown);
+  if ((ata = ata_pt_safe(ds))) {
+    /* ATA PASS-THROUGH (16), PIO data-in of one sector: SMART READ DATA */
+    cdb[0] = 0x85;
+    cdb[1] = 4 << 1;
+    cdb[2] = 0x0e;
+    cdb[4] = 0xd0;
+    cdb[6] = 0x01;
+    cdb[10] = 0x4f;
+    cdb[12] = 0xc2;
+    cdb[14] = 0xb0;
+    if (sg_command(name, cdb, 16, data, 512,
+                   (ds->quirk != NULL) ? ds->quirk->timeout : 0) < 0) {
+      return;
+    }
+    for (i = 2; i + 12 <= 362; i += 12) {
+      if (data[i] == 194) {
+        temp = data[i + 5];
+      }
+    }
 
-    /* Sync to make sure writing to the logfile won't cause another
-     * spinup in 30 seconds (or whatever bdflush uses as flush interval).
-     */
-    fclose(fp);
+  } else if (!strcmp(ds->transport, "scsi")) {
+    /* LOG SENSE, current cumulative values of the temperature page */
+    cdb[0] = 0x4d;
+    cdb[2] = 0x40 | 0x0d;
+    cdb[8] = 64;
+    if (sg_command(name, cdb, 10, data, 64,
+                   (ds->quirk != NULL) ? ds->quirk->timeout : 0) < 0) {
+      return;
+    }
+    if ((data[0] & 0x3f) == 0x0d && data[4] == 0 && data[5] == 0 && data[9] != 0xff) {
+      temp = data[9];
+    }
 
-    /* Don't be slow shutting down */
-    if (!break_loop) {
-      sleep(1);
-      if (!break_loop)
-        sync();
+  } else {
+    return;
+  }
+
+  snprintf(path, sizeof(path), "%s%s", SMART_FILE, ds->name);
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+  mkdir(RUN_DIR, 0755);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
+    return;
+  }
+  fprintf(fp, "time: %ld\n", (long) now);
+  if (temp >= 0) {
+    fprintf(fp, "temperature: %d\n", temp);
+  }
+  if (ata) {
+    /* id, current, worst, raw value (48 bits, little endian) */
+    for (i = 2; i + 12 <= 362; i += 12) {
+      unsigned long long raw = 0;
+      int j;
+      if (data[i] == 0) {
+        continue;
+      }
+      for (j = 10; j >= 5; j--) {
+        raw = (raw << 8) | data[i + j];
+      }
+      fprintf(fp, "attribute: %u %u %u %llu\n", data[i], data[i + 3],
+              data[i + 4], raw);
     }
   }
+  if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+    perror(path);
+    return;
+  }
+
+  dprintf("%s: SMART data collected (temperature %d)\n", ds->name, temp);
 }
 
-/* Resolve disk names specified as "/dev/disk/by-xxx" or some other symlink.
- * Please note that this function is only called during command line parsing
- * and hd-idle per se does not support dynamic disk additions or removals at
- * runtime.
+/* Buffer writes to a stopped disk. The kernel splits the dirty limit among
+ * devices (BDIs) in proportion to their recent writeback rate, which is zero
+ * for a stopped disk, thus its writers would be throttled right away.
+ * min_ratio reserves a share of the dirty limit for this disk and max_ratio
+ * caps it at the same size. strict_limit makes the kernel enforce that share
+ * even while the system as a whole is below its dirty thresholds (normally,
+ * the per-BDI limit only applies above them), so the disk can't take more
+ * than 'wbuf_size' of dirty memory.
  *
- * This might change in the future but would require some fiddling to avoid
- * needless overhead -- after all, this was designed to run on tiny embedded
- * devices, too.
+ * Delaying writeback by age is only possible system-wide
+ * (vm.dirty_expire_centisecs), thus this is raised while any disk is
+ * buffering: meanwhile, dirty data of all disks (the root filesystem's, too)
+ * is only written back early when it exceeds the background threshold, so
+ * that much is at risk system-wide. The original value is recorded in a
+ * journal in /run first and restored when no disk is buffering any more, on
+ * exit, or after a crash by the next instance (see wbuf_replay()). Buffered
+ * writes are flushed by restoring the original settings, either when the
+ * disk wakes up or when the oldest write may have reached the configured age.
  */
-static char *disk_name(char *path)
+static void wbuf_start(disk_stats_t *ds, time_t now)
 {
-  char buf[PATH_MAX + 1];
-  char *s;
+  char buf[20];
+  long limit = dirty_limit("dirty");
+  long ratio = 1;
 
-  if (*path != '/') {
-    /* just a disk name without /dev prefix */
-    return(path);
+  if (limit > 0) {
+    ratio = (wbuf_size * 100 + limit - 1) / limit;
   }
+  ratio = (ratio < 1) ? 1 : (ratio > 100) ? 100 : ratio;
 
-  if (realpath(path, buf) == NULL) {
-    char errmsg[PATH_MAX + 20];
-    snprintf(errmsg, sizeof(errmsg), "realpath(%s)", path);
-    perror(errmsg);
-    return(path);
+  if (wbuf_disks++ == 0 &&
+      sysfs_read(buf, sizeof(buf), "/proc/sys/vm/dirty_expire_centisecs") == 0 &&
+      atol(buf) < wbuf_age * 100L) {
+    wbuf_journal(buf);
+    snprintf(buf, sizeof(buf), "%ld", wbuf_age * 100L);
+    sysfs_set(&global_saved, buf, "/proc/sys/vm/dirty_expire_centisecs");
+    dprintf("vm.dirty_expire_centisecs raised to %s: up to %ld KiB of writes to "
+            "any disk may stay in memory for %d s\n", buf,
+            dirty_limit("dirty_background"), wbuf_age);
   }
 
-  /* remove partition numbers, if any */
-  for (s = buf + strlen(buf) - 1; s >= buf && isdigit(*s); s--) {
-    *s = '\0';
+  snprintf(buf, sizeof(buf), "%ld", ratio);
+  sysfs_set(&ds->saved, "1", "%s/%s/bdi/strict_limit", SYSFS_BLOCK, ds->name);
+  sysfs_set(&ds->saved, buf, "%s/%s/bdi/max_ratio", SYSFS_BLOCK, ds->name);
+  sysfs_set(&ds->saved, buf, "%s/%s/bdi/min_ratio", SYSFS_BLOCK, ds->name);
+
+  dprintf("%s: buffering writes for up to %d s, at most %ld KiB for this disk\n",
+          ds->name, wbuf_age, limit * ratio / 100);
+  ds->wbuf = 1;
+  ds->wbuf_since = now;
+}
+
+/* stop buffering writes, which flushes them (see wbuf_start()) */
+static void wbuf_end(disk_stats_t *ds)
+{
+  sysfs_unset(&ds->saved, "%s/%s/bdi/min_ratio", SYSFS_BLOCK, ds->name);
+  sysfs_unset(&ds->saved, "%s/%s/bdi/max_ratio", SYSFS_BLOCK, ds->name);
+  sysfs_unset(&ds->saved, "%s/%s/bdi/strict_limit", SYSFS_BLOCK, ds->name);
+  if (--wbuf_disks == 0 && global_saved != NULL) {
+    sysfs_restore(&global_saved);
+    wbuf_journal(NULL);
   }
+  ds->wbuf = 0;
+}
 
-  /* Extract basename of the disk in /dev. Note that this assumes that the
-   * final target of the symlink (if any) resolves to /dev/sd*
-   */
-  if ((s = strrchr(buf, '/')) != NULL) {
-    s++;
-  } else {
-    s = buf;
+/* Record the original vm.dirty_expire_centisecs before raising it, or remove
+ * the record once it's restored ('value' == NULL)
+ */
+static void wbuf_journal(const char *value)
+{
+  char tmp[sizeof(WBUF_JOURNAL) + 4];
+  FILE *fp;
+
+  if (value == NULL) {
+    if (unlink(WBUF_JOURNAL) < 0 && errno != ENOENT) {
+      perror(WBUF_JOURNAL);
+    }
+    return;
   }
 
-  if ((s = strdup(s)) == NULL) {
-    fprintf(stderr, "out of memory");
-    exit(2);
+  snprintf(tmp, sizeof(tmp), "%s.new", WBUF_JOURNAL);
+  mkdir(RUN_DIR, 0755);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
+    return;
+  }
+  fprintf(fp, "%s\n", value);
+  if (fclose(fp) != 0 || rename(tmp, WBUF_JOURNAL) < 0) {
+    perror(WBUF_JOURNAL);
   }
+}
 
-  dprintf("using %s for %s\n", s, path);
-  return(s);
+/* restore vm.dirty_expire_centisecs if a previous instance left it raised */
+static void wbuf_replay(void)
+{
+  char buf[20];
+
+  if (sysfs_read(buf, sizeof(buf), "%s", WBUF_JOURNAL) < 0) {
+    return;
+  }
+  if (sysfs_write(buf, "/proc/sys/vm/dirty_expire_centisecs") == 0) {
+    dprintf("vm.dirty_expire_centisecs restored to %s from journal\n", buf);
+  }
+  unlink(WBUF_JOURNAL);
 }
 
-/* print hex dump to stderr (e.g. sense buffers) */
-static void phex(FILE *fp, const void *p, int len, const char *fmt, ...)
+/* Get one of the system's dirty page limits in KiB, 'name' being "dirty" or
+ * "dirty_background": vm.<name>_bytes or vm.<name>_ratio percent of the
+ * available memory; returns -1 if unknown
+ */
+static long dirty_limit(const char *name)
 {
-  va_list va;
-  const unsigned char *buf = p;
-  int pos = 0;
-  int i;
+  char buf[4096];
+  char *s;
+  long bytes;
 
-  /* print header */
-  va_start(va, fmt);
-  vfprintf(fp, fmt, va);
+  if (sysfs_read(buf, sizeof(buf), "/proc/sys/vm/%s_bytes", name) == 0 &&
+      (bytes = atol(buf)) > 0) {
+    return(bytes / 1024);
+  }
 
-  /* print hex block */
-  while (len > 0) {
-    fprintf(fp, "%08x ", pos);
+  if (sysfs_read(buf, sizeof(buf), "/proc/meminfo") < 0 ||
+      (s = strstr(buf, "MemAvailable:")) == NULL) {
+    return(-1);
+  }
+  bytes = atol(s + 13);
+  if (sysfs_read(buf, sizeof(buf), "/proc/sys/vm/%s_ratio", name) < 0) {
+    return(-1);
+  }
 
-    /* print hex block */
-    for (i = 0; i < 16; i++) {
-      if (i < len) {
-        fprintf(fp, "%c%02x", ((i == 8) ? '-' : ' '), buf[i]);
-      } else {
-        fprintf(fp, "   ");
+  return(bytes * atol(buf) / 100);
+}
+
+/* Scan md RAID1 arrays for active members, in the order md lists them */
+static mirror_t *mirror_scan(void)
+{
+  mirror_t *root = NULL;
+  mirror_t **mp = &root;
+  DIR *dir;
+  DIR *md_dir;
+  struct dirent *de;
+  struct dirent *me;
+  char path[PATH_MAX];
+  char buf[PATH_MAX + 300];
+  char dev[PATH_MAX];
+
+  if ((dir = opendir(SYSFS_BLOCK)) == NULL) {
+    return(NULL);
+  }
+
+  while ((de = readdir(dir)) != NULL) {
+    if (strncmp(de->d_name, "md", 2) ||
+        sysfs_read(buf, sizeof(buf), "%s/%s/md/level", SYSFS_BLOCK, de->d_name) < 0 ||
+        strcmp(buf, "raid1")) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s/md", SYSFS_BLOCK, de->d_name);
+    if ((md_dir = opendir(path)) == NULL) {
+      continue;
+    }
+    while ((me = readdir(md_dir)) != NULL) {
+      mirror_t *m;
+      char state[64];
+
+      if (strncmp(me->d_name, "dev-", 4) ||
+          sysfs_read(state, sizeof(state), "%s/%s/state", path, me->d_name) < 0 ||
+          strstr(state, "faulty") != NULL || strstr(state, "spare") != NULL) {
+        continue;
+      }
+
+      /* the member's block device may be a partition; we need the disk */
+      snprintf(buf, sizeof(buf), "%s/%s/block", path, me->d_name);
+      if (realpath(buf, dev) == NULL) {
+        continue;
       }
+      snprintf(buf, sizeof(buf), "%s/partition", dev);
+      if (access(buf, F_OK) == 0) {
+        *strrchr(dev, '/') = '\0';
+      }
+
+      if ((m = calloc(1, sizeof(*m))) == NULL) {
+        break;
+      }
+      snprintf(m->md, sizeof(m->md), "%s", de->d_name);
+      snprintf(m->dev, sizeof(m->dev), "%s", me->d_name);
+      snprintf(m->disk, sizeof(m->disk), "%s", strrchr(dev, '/') + 1);
+      m->was_wm = (strstr(state, "write_mostly") != NULL);
+      *mp = m;
+      mp = &m->next;
     }
+    closedir(md_dir);
+  }
 
-    /* print ASCII block */
-    fprintf(fp, "   ");
-    for (i = 0; i < ((len > 16) ? 16 : len); i++) {
-      fprintf(fp, "%c", (buf[i] >= 32 && buf[i] < 128) ? buf[i] : '.');
+  closedir(dir);
+  return(root);
+}
+
+/* Steer reads of RAID1 arrays to a single member (primary) by marking all
+ * others write-mostly; those only wake up for writes and can be stopped
+ * otherwise. The primary rotates on each call to balance wear. Arrays are
+ * rescanned each time; the previous list is released. Members seen for the
+ * first time haven't been steered so far, thus their spin-ups since hd-idle
+ * started are reported and kept as the figures before read steering.
+ */
+static mirror_t *mirror_rotate(mirror_t *old, disk_stats_t *ds_root,
+                               time_t started)
+{
+  mirror_t *root = mirror_scan();
+  mirror_t *first;
+  mirror_t *end;
+  mirror_t *m;
+  mirror_t *o;
+  disk_stats_t *ds;
+  time_t now = time(NULL);
+
+  mirror_report(old, ds_root);
+
+  for (m = root; m != NULL; m = m->next) {
+    /* keep the original write-mostly flag of known members */
+    for (o = old; o != NULL && (strcmp(o->md, m->md) || strcmp(o->dev, m->dev));
+         o = o->next);
+    for (ds = ds_root; ds != NULL && strcmp(ds->name, m->disk); ds = ds->next);
+    m->spinups = (ds != NULL) ? ds->spinups : 0;
+    m->since = now;
+    if (o != NULL) {
+      m->was_wm = o->was_wm;
+      m->before = o->before;
+      m->before_secs = o->before_secs;
+    } else {
+      m->before = m->spinups;
+      m->before_secs = now - started;
+      fprintf(stderr, "%s: %s (%s) spun up %lu time(s) in %.1f h before read "
+              "steering\n", m->md, m->disk, m->dev + 4, m->before,
+              m->before_secs / 3600.0);
     }
-    fprintf(fp, "\n");
+  }
 
-    pos += 16;
-    buf += 16;
-    len -= 16;
+  for (first = root; first != NULL; first = end) {
+    mirror_t *primary = NULL;
+
+    for (end = first; end != NULL && !strcmp(end->md, first->md); end = end->next);
+    if (first->next == end) {
+      /* nothing to steer with a single active member */
+      continue;
+    }
+
+    /* pick the member after the previous primary, if it's still there */
+    for (o = old; o != NULL && (strcmp(o->md, first->md) || !o->primary); o = o->next);
+    if (o != NULL) {
+      for (o = o->next; o != NULL && !strcmp(o->md, first->md) && primary == NULL;
+           o = o->next) {
+        for (m = first; m != end && strcmp(m->dev, o->dev); m = m->next);
+        primary = (m != end) ? m : NULL;
+      }
+    }
+    if (primary == NULL) {
+      primary = first;
+    }
+    primary->primary = 1;
+
+    /* clear write-mostly on the new primary first so there's always a
+     * member serving reads
+     */
+    mirror_state(primary, "-writemostly");
+    for (m = first; m != end; m = m->next) {
+      if (m != primary) {
+        mirror_state(m, "writemostly");
+      }
+    }
+    dprintf("%s: reading from %s\n", primary->md, primary->disk);
+  }
+
+  while ((o = old) != NULL) {
+    old = old->next;
+    free(o);
   }
+  return(root);
 }
 
-/* make sure this is a SCSI disk (sd[a-z]*) */
-static int is_scsi_disk(const char *name)
+/* Restore the original write-mostly flags of RAID1 members and release the
+ * list of members
+ */
+static void mirror_restore(mirror_t *m, disk_stats_t *ds_root)
 {
-  char dev_name[100];
-  struct stat st;
+  mirror_t *next;
 
-  snprintf(dev_name, sizeof(dev_name), "/dev/%s", name);
-  if (stat(dev_name, &st) < 0) {
-    char buf[100];
-    snprintf(buf, sizeof(buf), "stat(%s):", dev_name);
-    perror(buf);
-    return 0;
+  mirror_report(m, ds_root);
+
+  for (; m != NULL; m = next) {
+    next = m->next;
+    mirror_state(m, (m->was_wm) ? "writemostly" : "-writemostly");
+    free(m);
+  }
+}
+
+/* report the spin-ups of RAID1 members since the last rotation, next to
+ * those before read steering
+ */
+static void mirror_report(mirror_t *m, disk_stats_t *ds_root)
+{
+  disk_stats_t *ds;
+  time_t now = time(NULL);
+
+  for (; m != NULL; m = m->next) {
+    for (ds = ds_root; ds != NULL && strcmp(ds->name, m->disk); ds = ds->next);
+    if (ds != NULL) {
+      fprintf(stderr, "%s: %s (%s) spun up %lu time(s) in %.1f h as %s, "
+              "before read steering %lu time(s) in %.1f h\n", m->md, m->disk,
+              m->dev + 4, ds->spinups - m->spinups, (now - m->since) / 3600.0,
+              (m->primary) ? "primary" : "write-mostly member", m->before,
+              m->before_secs / 3600.0);
+    }
   }
+}
 
-  /* SCSI disk and a whole disk (not partition) */
-  return (major(st.st_rdev) == 8) && (minor(st.st_rdev) % 16 == 0);
+/* set the state of a RAID1 member ("writemostly" or "-writemostly") */
+static int mirror_state(mirror_t *m, const char *value)
+{
+  char path[PATH_MAX];
+  int fd;
+  int ok;
+
+  snprintf(path, sizeof(path), "%s/%s/md/%s/state", SYSFS_BLOCK, m->md, m->dev);
+  if ((fd = open(path, O_WRONLY)) < 0) {
+    dprintf("%s: %s\n", path, strerror(errno));
+    return(-1);
+  }
+  ok = (write(fd, value, strlen(value)) == (ssize_t) strlen(value));
+  close(fd);
+
+  if (!ok) {
+    fprintf(stderr, "%s: can't set %s\n", path, value);
+    return(-1);
+  }
+  dprintf("%s: set %s\n", path, value);
+  return(0);
+}
+
+/* Hand over spin-down of a disk to the kernel: with manage_runtime_start_stop
+ * (Linux 6.6, formerly manage_start_stop), the sd driver stops the disk when
+ * it's runtime-suspended after 'autosuspend_delay_ms' of inactivity, and
+ * starts it again on the next request, without any race with incoming I/O.
+ * The settings are verified by reading them back; the original values are
+ * restored on detach. Returns 0 if runtime PM was set up.
+ */
+static int runtime_pm_setup(disk_stats_t *ds)
+{
+  char dir[PATH_MAX];
+  char delay[20];
+
+  if (scsi_disk_dir(ds->name, dir, sizeof(dir)) < 0) {
+    return(-1);
+  }
+
+  snprintf(delay, sizeof(delay), "%d", ds->idle_time * 1000);
+  if ((sysfs_set(&ds->rpm_saved, "1", "%s/manage_runtime_start_stop", dir) < 0 &&
+       sysfs_set(&ds->rpm_saved, "1", "%s/manage_start_stop", dir) < 0) ||
+      sysfs_set(&ds->rpm_saved, delay, "%s/%s/device/power/autosuspend_delay_ms",
+                SYSFS_BLOCK, ds->name) < 0 ||
+      sysfs_set(&ds->rpm_saved, "auto", "%s/%s/device/power/control",
+                SYSFS_BLOCK, ds->name) < 0) {
+    dprintf("%s: runtime PM not supported\n", ds->name);
+    sysfs_restore(&ds->rpm_saved);
+    return(-1);
+  }
+
+  dprintf("%s: using runtime PM, autosuspend delay %s ms\n", ds->name, delay);
+  return(0);
+}
+
+/* Find idle time for a disk. Explicit disk names take precedence over
+ * mountpoints and filesystem UUIDs (see resolve_rules()), which take
+ * precedence over profile names ("@<profile>"), which take precedence over the
+ * profile's default idle time (with "-A"), which takes precedence over the
+ * default entry. The default entry has 'it->name == NULL' and will always be
+ * the last due to the way this single-linked list is built when parsing
+ * command line arguments.
+ */
+static int find_idle_time(idle_time_t *it, disk_stats_t *ds, int *latency)
+{
+  idle_time_t *it_profile = NULL;
+  profile_t *p;
+
+  for (; it != NULL; it = it->next) {
+    if (it->name == NULL) {
+      break;
+    } else if (it->mount) {
+      continue;
+    } else if (!strcmp(ds->name, it->name)) {
+      *latency = it->latency;
+      return(it->idle_time);
+    } else if (it_profile == NULL && ds->profile != NULL &&
+               *it->name == '@' && !strcmp(ds->profile, it->name + 1)) {
+      it_profile = it;
+    }
+  }
+
+  if (ds->mount_rule) {
+    *latency = ds->mount_latency;
+    return(ds->mount_idle);
+  }
+  if (it_profile != NULL) {
+    *latency = it_profile->latency;
+    return(it_profile->idle_time);
+  }
+  *latency = (it != NULL) ? it->latency : -1;
+  if (auto_profile && ds->profile != NULL) {
+    for (p = profiles; p->name != NULL; p++) {
+      if (!strcmp(p->name, ds->profile)) {
+        return(p->idle_time);
+      }
+    }
+  }
+
+  return((it != NULL) ? it->idle_time : DEFAULT_IDLE_TIME);
+}
+
+/* Check whether an argument of "-a" is a mountpoint (any directory, in fact)
+ * or a filesystem UUID ("UUID=..."); returns the rule's name in canonical
+ * form (allocated) or NULL if it's neither
+ */
+static char *mount_rule(const char *arg)
+{
+  struct stat st;
+  char *s;
+
+  if (!strncmp(arg, "UUID=", 5)) {
+    s = strdup(arg);
+  } else if (stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+    s = realpath(arg, NULL);
+  } else {
+    return(NULL);
+  }
+
+  if (s == NULL) {
+    fprintf(stderr, "out of memory");
+    exit(2);
+  }
+  dprintf("using filesystem %s\n", s);
+  return(s);
+}
+
+typedef struct rule_match_t {
+  disk_stats_t         *ds_root;
+  int                  idle_time;
+  int                  latency;
+} rule_match_t;
+
+/* Merge the idle time of a mountpoint/UUID rule into a disk: when several
+ * filesystems with different rules share a disk, the longest idle time wins
+ * and 0 (never spin down) beats any other; likewise the smallest wake latency
+ * budget wins
+ */
+static void rule_disk(const char *disk, void *arg)
+{
+  rule_match_t *rm = arg;
+  disk_stats_t *ds = get_diskstats(rm->ds_root, disk);
+
+  if (ds == NULL) {
+    return;
+  }
+  if (!ds->mount_rule || rm->idle_time == 0 ||
+      (ds->mount_idle != 0 && rm->idle_time > ds->mount_idle)) {
+    ds->mount_idle = rm->idle_time;
+  }
+  if (!ds->mount_rule || (rm->latency >= 0 &&
+      (ds->mount_latency < 0 || rm->latency < ds->mount_latency))) {
+    ds->mount_latency = rm->latency;
+  }
+  ds->mount_rule = 1;
+}
+
+/* Resolve mountpoint and UUID rules to the physical disks below them, through
+ * partitions and stacked devices (see dev_disks()), and update the idle time
+ * of each disk. This is called whenever the mount table changes. Paths which
+ * aren't mountpoints themselves belong to the filesystem with the longest
+ * mountpoint prefix; UUIDs are looked up in /dev/disk/by-uuid, thus apply
+ * whether or not the filesystem is mounted.
+ */
+static void resolve_rules(idle_time_t *it_root, mount_t *mnt, disk_stats_t *ds_root)
+{
+  idle_time_t *it;
+  rule_match_t rm;
+  disk_stats_t *ds;
+
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    ds->mount_rule = 0;
+  }
+
+  rm.ds_root = ds_root;
+  for (it = it_root; it != NULL; it = it->next) {
+    unsigned int major = 0;
+    unsigned int minor = 0;
+    int found = 0;
+
+    if (!it->mount) {
+      continue;
+    }
+    if (*it->name == '/') {
+      /* the mount table is listed newest first, thus on equal length, the
+       * first match is the topmost of stacked mounts
+       */
+      size_t best = 0;
+      mount_t *m;
+      for (m = mnt; m != NULL; m = m->next) {
+        size_t len = strlen(m->target);
+        if (!strncmp(it->name, m->target, len) && len > best &&
+            (it->name[len] == '/' || it->name[len] == '\0' || len == 1)) {
+          major = m->major;
+          minor = m->minor;
+          best = len;
+          found = 1;
+        }
+      }
+    } else {
+      char path[PATH_MAX];
+      struct stat st;
+      snprintf(path, sizeof(path), "/dev/disk/by-uuid/%s", it->name + 5);
+      if (stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+        major = major(st.st_rdev);
+        minor = minor(st.st_rdev);
+        found = 1;
+      }
+    }
+    if (found) {
+      rm.idle_time = it->idle_time;
+      rm.latency = it->latency;
+      dev_disks(major, minor, rule_disk, &rm);
+    }
+  }
+
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    int idle_time;
+    int latency;
+
+    if (!ds->probed || (ds->mpath != NULL && ds->mpath != ds) ||
+        ((idle_time = find_idle_time(it_root, ds, &latency)) == ds->idle_time &&
+         latency == ds->latency)) {
+      continue;
+    }
+    dprintf("%s: idle time %d, wake latency budget %d ms\n", ds->name,
+            idle_time, latency);
+    ds->idle_time = idle_time;
+    ds->latency = latency;
+    if (ds->rpm) {
+      /* update the autosuspend delay */
+      sysfs_restore(&ds->rpm_saved);
+      ds->rpm = (idle_time != 0 && latency < 0 && runtime_pm_setup(ds) == 0);
+    }
+  }
+}
+
+/* Determine the profile of a disk from its sysfs attributes. Card readers
+ * tend to claim rotational media, thus the removable flag is checked first.
+ */
+static const char *disk_profile(const char *name, const char *transport)
+{
+  char buf[20];
+
+  if (sysfs_read(buf, sizeof(buf), "%s/%s/removable", SYSFS_BLOCK, name) == 0 &&
+      atoi(buf) != 0) {
+    return("card-reader");
+  }
+
+  if (sysfs_read(buf, sizeof(buf), "%s/%s/queue/rotational", SYSFS_BLOCK, name) == 0 &&
+      atoi(buf) == 0) {
+    return("ssd");
+  }
+
+  if (!strcmp(transport, "usb")) {
+    return("usb-hdd");
+  } else if (!strcmp(transport, "ata")) {
+    return("sata-hdd");
+  }
+
+  return(NULL);
+}
+
+/* Determine how a disk is attached: "usb", "ieee1394", "ata" (libata, which
+ * reports "ATA" as vendor) or "scsi" for anything else, i.e. real SCSI/SAS
+ */
+static const char *disk_transport(const char *name)
+{
+  char buf[PATH_MAX];
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/%s/device", SYSFS_BLOCK, name);
+  if (realpath(path, buf) != NULL) {
+    if (strstr(buf, "/usb") != NULL) {
+      return("usb");
+    } else if (strstr(buf, "/fw") != NULL) {
+      return("ieee1394");
+    }
+  }
+
+  if (sysfs_read(buf, sizeof(buf), "%s/%s/device/vendor", SYSFS_BLOCK, name) == 0 &&
+      !strcmp(buf, "ATA")) {
+    return("ata");
+  }
+
+  return("scsi");
+}
+
+/* Find the quirks of a disk by the USB vendor and product ID of the bridge it's
+ * attached to and its model name; returns NULL if there are none. This is
+ * called once per disk, on attach.
+ */
+static const quirk_t *find_quirk(const char *name)
+{
+  char path[PATH_MAX];
+  char dir[PATH_MAX];
+  char model[50];
+  char buf[20];
+  unsigned int vid = 0;
+  unsigned int pid = 0;
+  quirk_t *q;
+  char *s;
+  int i;
+
+  /* the USB device is one of the ancestors of the SCSI device */
+  snprintf(path, sizeof(path), "%s/%s/device", SYSFS_BLOCK, name);
+  if (realpath(path, dir) == NULL) {
+    return(NULL);
+  }
+  while ((s = strrchr(dir, '/')) != NULL && s != dir) {
+    *s = '\0';
+    if (sysfs_read(buf, sizeof(buf), "%s/idVendor", dir) == 0) {
+      vid = (unsigned int) strtoul(buf, NULL, 16);
+      if (sysfs_read(buf, sizeof(buf), "%s/idProduct", dir) == 0) {
+        pid = (unsigned int) strtoul(buf, NULL, 16);
+      }
+      break;
+    }
+  }
+  if (sysfs_read(model, sizeof(model), "%s/model", path) < 0) {
+    *model = '\0';
+  }
+
+  for (q = user_quirks; q != NULL && !quirk_match(q, vid, pid, model); q = q->next);
+  for (i = 0; q == NULL && (quirks[i].vid != 0 || quirks[i].pid != 0); i++) {
+    if (quirk_match(&quirks[i], vid, pid, model)) {
+      q = &quirks[i];
+    }
+  }
+  if (q == NULL) {
+    return(NULL);
+  }
+
+  dprintf("%s: quirks %04x:%04x%s%s: flags 0x%x, timeout %d ms\n", name,
+          q->vid, q->pid, (q->model != NULL) ? ":" : "",
+          (q->model != NULL) ? q->model : "", q->flags, q->timeout);
+  return(q);
+}
+
+/* match a quirk against the USB IDs and model name of a disk */
+static int quirk_match(const quirk_t *q, unsigned int vid, unsigned int pid,
+                       const char *model)
+{
+  return(q->vid == vid && q->pid == pid &&
+         (q->model == NULL || !strncmp(model, q->model, strlen(q->model))));
+}
+
+/* Add a quirk given as <vid>:<pid>[:<model prefix>]=<flag>[,<flag>...] with
+ * flags "immed", "standby", "pt", "no-pt" and "timeout=<ms>"; returns -1 if
+ * the quirk can't be parsed
+ */
+static int add_quirk(const char *arg)
+{
+  quirk_t *q;
+  char *buf;
+  char *flags;
+  char *model;
+  char *s;
+
+  if ((q = calloc(1, sizeof(*q))) == NULL || (buf = strdup(arg)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  if ((flags = strchr(buf, '=')) == NULL ||
+      sscanf(buf, "%x:%x", &q->vid, &q->pid) != 2) {
+    goto error;
+  }
+  *flags++ = '\0';
+  if ((model = strchr(buf, ':')) != NULL && (model = strchr(model + 1, ':')) != NULL &&
+      (q->model = strdup(model + 1)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(2);
+  }
+
+  for (s = strtok(flags, ","); s != NULL; s = strtok(NULL, ",")) {
+    if (!strcmp(s, "immed")) {
+      q->flags |= Q_IMMED;
+    } else if (!strcmp(s, "standby")) {
+      q->flags |= Q_ATA_STANDBY;
+    } else if (!strcmp(s, "pt")) {
+      q->flags |= Q_PT;
+    } else if (!strcmp(s, "no-pt")) {
+      q->flags |= Q_NO_PT;
+    } else if (!strncmp(s, "timeout=", 8)) {
+      q->timeout = atoi(s + 8);
+    } else {
+      goto error;
+    }
+  }
+
+  free(buf);
+  q->next = user_quirks;
+  user_quirks = q;
+  return(0);
+
+error:
+  fprintf(stderr, "error: invalid quirk %s\n", arg);
+  free(buf);
+  free((char *) q->model);
+  free(q);
+  return(-1);
+}
+
+/* Check whether ATA commands can be sent to a disk via ATA PASS-THROUGH: disks
+ * on libata translate them, USB bridges only if their quirks say so
+ */
+static int ata_pt_safe(disk_stats_t *ds)
+{
+  const quirk_t *q = ds->quirk;
+
+  if (q != NULL && (q->flags & Q_NO_PT)) {
+    return(0);
+  }
+  return(!strcmp(ds->transport, "ata") ||
+         (q != NULL && (q->flags & (Q_PT | Q_ATA_STANDBY))));
+}
+
+/* Check whether a disk will be started again after having been stopped.
+ * Disks behind USB, IEEE1394 and libata start automatically on the next
+ * request. Real SCSI disks only do so with "-S": allow_restart makes sd
+ * issue a START UNIT command when the disk reports that it needs one, and
+ * manage_start_stop makes the kernel stop and start the disk across system
+ * suspend. These attributes are not restored on exit because the disk may
+ * be stopped at that time. Finally, a START UNIT round trip proves the disk
+ * accepts the command. Returns 0 if the disk can be stopped.
+ */
+static int check_restart(disk_stats_t *ds)
+{
+  char dir[PATH_MAX];
+
+  if (strcmp(ds->transport, "scsi") || !scsi_restart) {
+    ds->restart_ok = 1;
+    return(0);
+  }
+
+  if (scsi_disk_dir(ds->name, dir, sizeof(dir)) < 0 ||
+      sysfs_write("1", "%s/allow_restart", dir) < 0) {
+    return(-1);
+  }
+  if (sysfs_write("1", "%s/manage_system_start_stop", dir) < 0 &&
+      sysfs_write("1", "%s/manage_start_stop", dir) < 0) {
+    dprintf("%s: can't set manage_start_stop\n", ds->name);
+  }
+  if (start_disk(ds->name, ds->quirk) < 0) {
+    return(-1);
+  }
+
+  ds->restart_ok = 1;
+  return(0);
+}
+
+/* Read a sysfs attribute into 'buf', removing trailing whitespace; returns 0
+ * on success and -1 if the attribute doesn't exist or can't be read
+ */
+static int sysfs_read(char *buf, int len, const char *fmt, ...)
+{
+  char path[PATH_MAX];
+  va_list va;
+  int fd;
+  int n;
+
+  va_start(va, fmt);
+  vsnprintf(path, sizeof(path), fmt, va);
+  va_end(va);
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    return(-1);
+  }
+  n = read(fd, buf, len - 1);
+  close(fd);
+  if (n < 0) {
+    return(-1);
+  }
+
+  while (n > 0 && isspace((unsigned char) buf[n - 1])) {
+    n--;
+  }
+  buf[n] = '\0';
+  return(0);
+}
+
+/* Set a sysfs attribute, saving its original value for sysfs_restore();
+ * returns 0 on success and -1 if the attribute can't be read, written or
+ * doesn't stick (see sysfs_write())
+ */
+static int sysfs_set(sysfs_attr_t **saved, const char *value, const char *fmt, ...)
+{
+  char path[PATH_MAX];
+  char buf[sizeof((*saved)->value)];
+  sysfs_attr_t *sa;
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(path, sizeof(path), fmt, va);
+  va_end(va);
+
+  if (sysfs_read(buf, sizeof(buf), "%s", path) < 0) {
+    return(-1);
+  }
+  if (!strcmp(buf, value)) {
+    return(0);
+  }
+
+  if ((sa = malloc(sizeof(*sa))) == NULL || (sa->path = strdup(path)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    free(sa);
+    return(-1);
+  }
+  strcpy(sa->value, buf);
+
+  /* remember the original value even if the new one doesn't stick */
+  sa->next = *saved;
+  *saved = sa;
+
+  return(sysfs_write(value, "%s", path));
+}
+
+/* Write a sysfs attribute and verify the new value by reading it back;
+ * returns 0 on success
+ */
+static int sysfs_write(const char *value, const char *fmt, ...)
+{
+  char path[PATH_MAX];
+  char buf[32];
+  va_list va;
+  int fd;
+  int ok;
+
+  va_start(va, fmt);
+  vsnprintf(path, sizeof(path), fmt, va);
+  va_end(va);
+
+  if ((fd = open(path, O_WRONLY)) < 0) {
+    dprintf("%s: %s\n", path, strerror(errno));
+    return(-1);
+  }
+  ok = (write(fd, value, strlen(value)) == (ssize_t) strlen(value));
+  close(fd);
+
+  if (!ok || sysfs_read(buf, sizeof(buf), "%s", path) < 0 || strcmp(buf, value)) {
+    dprintf("%s: can't set to %s\n", path, value);
+    return(-1);
+  }
+
+  dprintf("%s: set to %s\n", path, value);
+  return(0);
+}
+
+/* restore sysfs attributes changed by sysfs_set() in reverse order */
+static void sysfs_restore(sysfs_attr_t **saved)
+{
+  while (*saved != NULL) {
+    restore_attr(saved);
+  }
+}
+
+/* restore a single sysfs attribute changed by sysfs_set() */
+static void sysfs_unset(sysfs_attr_t **saved, const char *fmt, ...)
+{
+  char path[PATH_MAX];
+  sysfs_attr_t **sap;
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(path, sizeof(path), fmt, va);
+  va_end(va);
+
+  for (sap = saved; *sap != NULL; sap = &(*sap)->next) {
+    if (!strcmp((*sap)->path, path)) {
+      restore_attr(sap);
+      break;
+    }
+  }
+}
+
+/* write back the saved value of a sysfs attribute and unlink it */
+static void restore_attr(sysfs_attr_t **sap)
+{
+  sysfs_attr_t *sa = *sap;
+  int fd;
+
+  *sap = sa->next;
+  if ((fd = open(sa->path, O_WRONLY)) < 0 && errno == ENOENT) {
+    /* the disk is gone */
+  } else if (fd < 0 || write(fd, sa->value, strlen(sa->value)) < 0) {
+    perror(sa->path);
+  } else {
+    dprintf("%s: restored %s\n", sa->path, sa->value);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(sa->path);
+  free(sa);
+}
+
+/* Get the scsi_disk class directory of a disk, i.e.
+ * /sys/block/<name>/device/scsi_disk/<h:c:t:l>; returns -1 if not found
+ */
+static int scsi_disk_dir(const char *name, char *buf, int len)
+{
+  struct dirent *de;
+  DIR *dir;
+  int rc = -1;
+
+  snprintf(buf, len, "%s/%s/device/scsi_disk", SYSFS_BLOCK, name);
+  if ((dir = opendir(buf)) == NULL) {
+    return(-1);
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (*de->d_name != '.') {
+      snprintf(buf, len, "%s/%s/device/scsi_disk/%s", SYSFS_BLOCK, name,
+               de->d_name);
+      rc = 0;
+      break;
+    }
+  }
+  closedir(dir);
+
+  return(rc);
+}
+
+/* Estimate when the I/O detected in the last polling interval actually ended.
+ *
+ * The disk was busy for 'io_ticks' milliseconds since the previous poll, thus
+ * the I/O can't have ended before 'last_poll + busy' and not after 'now'. The
+ * midpoint of this window is used, which keeps the error within half the idle
+ * part of the interval in either direction, compared to up to one polling
+ * interval late when using the time of the poll itself. Requests still in
+ * flight mean the disk is still busy; a time-in-queue delta without any busy
+ * ticks accounts for I/O shorter than one tick.
+ */
+static time_t estimate_last_io(disk_stats_t *ds, disk_stats_t *tmp, time_t now)
+{
+  long interval = (long) (now - ds->last_poll) * 1000;
+  long busy = (long) (tmp->io_ticks - ds->io_ticks);
+  long est;
+
+  if (tmp->in_flight != 0 || interval <= 0 || busy >= interval) {
+    return(now);
+  }
+  if (busy == 0 && tmp->in_queue != ds->in_queue) {
+    /* I/O accounted but less than a tick of busy time */
+    busy = 1;
+  }
+
+  est = busy + (interval - busy) / 2;
+  dprintf("%s: busy %ld of %ld ms, last I/O estimated %ld s before poll\n",
+          ds->name, busy, interval, (interval - est) / 1000);
+
+  return(ds->last_poll + est / 1000);
+}
+
+/* Get the time of the next wakeup given the time of the next regular poll;
+ * this is the earliest spin-down deadline of all running disks if it comes
+ * before the regular poll.
+ *
+ * With a slack > 0, the wakeup is postponed to the latest deadline (or the
+ * regular poll) falling within 'slack' seconds of the earliest one, thus
+ * batching spin-downs of disks with slightly different idle periods into a
+ * single wakeup at the price of stopping some of them up to 'slack' seconds
+ * late. 'merged' returns the number of wakeups saved this way.
+ */
+static time_t next_wakeup(disk_stats_t *ds_root, time_t polled, time_t poll,
+                          int slack, int *merged)
+{
+  disk_stats_t *ds;
+  disk_stats_t *ds2;
+  time_t earliest = poll;
+  time_t wakeup;
+  time_t deadline;
+
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    if ((deadline = due_time(ds, polled, poll)) != 0 && deadline < earliest) {
+      earliest = deadline;
+    }
+  }
+
+  *merged = 0;
+  if (slack <= 0) {
+    return(earliest);
+  }
+
+  /* postpone to the latest candidate within the slack window */
+  wakeup = (poll <= earliest + slack) ? poll : earliest;
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    if ((deadline = due_time(ds, polled, poll)) > wakeup &&
+        deadline <= earliest + slack) {
+      wakeup = deadline;
+    }
+  }
+
+  /* count distinct wakeup times merged into this one */
+  if (poll > earliest && poll <= wakeup) {
+    (*merged)++;
+  }
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    deadline = due_time(ds, polled, poll);
+    if (deadline <= earliest || deadline > wakeup || deadline == poll) {
+      continue;
+    }
+    for (ds2 = ds_root; ds2 != ds && due_time(ds2, polled, poll) != deadline;
+         ds2 = ds2->next);
+    if (ds2 == ds) {
+      (*merged)++;
+    }
+  }
+
+  return(wakeup);
+}
+
+/* Get a disk's deadline for scheduling the next wakeup. A deadline which had
+ * already passed when the disk was last polled didn't lead to a spin-down
+ * (e.g. because the command failed or no power state fits), thus it's moved
+ * to the next regular poll rather than waking up every second.
+ */
+static time_t due_time(disk_stats_t *ds, time_t polled, time_t poll)
+{
+  time_t deadline = disk_deadline(ds);
+
+  return((deadline != 0 && deadline <= polled) ? poll : deadline);
+}
+
+/* Get the time at which a disk is due to be spun down by hd-idle or 0 if
+ * it's not (never to be spun down or left to the kernel). For stopped disks,
+ * this is the time at which buffered writes are due to be flushed, if any.
+ */
+static time_t disk_deadline(disk_stats_t *ds)
+{
+  time_t deadline;
+
+  if (ds->spun_down && wbuf_age >= 0) {
+    return(ds->wbuf_since + ((ds->wbuf) ? wbuf_age : WBUF_SETTLE));
+  }
+  if (ds->spun_down || ds->rpm || ds->idle_time == 0) {
+    return(0);
+  }
+  deadline = ds->last_io + ds->idle_time;
+  if (ds->streaming && ds->last_io + stream_timeout < deadline) {
+    deadline = ds->last_io + stream_timeout;
+  }
+  if (ds->stop_at != 0 && ds->stop_at < deadline) {
+    deadline = ds->stop_at;
+  }
+  if (ds->retry_at > deadline) {
+    deadline = ds->retry_at;
+  }
+  return(deadline);
+}
+
+/* Read the mount table (/proc/self/mountinfo); lines look like this:
+ *
+ *   36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw
+ *
+ * Only mounts of block devices (major != 0) are returned.
+ */
+static mount_t *read_mounts(int fd)
+{
+  mount_t *mnt_root = NULL;
+  mount_t *mnt;
+  FILE *fp;
+  char buf[PATH_MAX + 200];
+  char target[PATH_MAX];
+  unsigned int major, minor;
+
+  if ((fd = dup(fd)) < 0 || lseek(fd, 0, SEEK_SET) < 0 ||
+      (fp = fdopen(fd, "r")) == NULL) {
+    perror(MOUNT_FILE);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return(NULL);
+  }
+
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    char *r;
+    char *w;
+
+    if (sscanf(buf, "%*u %*u %u:%u %*s %4095s", &major, &minor, target) != 3 ||
+        major == 0) {
+      continue;
+    }
+
+    /* unescape octal sequences (e.g. "\040" for blanks) */
+    for (r = w = target; *r != '\0'; w++) {
+      if (r[0] == '\\' && isdigit((unsigned char) r[1]) &&
+          isdigit((unsigned char) r[2]) && isdigit((unsigned char) r[3])) {
+        *w = (char) (((r[1] - '0') << 6) | ((r[2] - '0') << 3) | (r[3] - '0'));
+        r += 4;
+      } else {
+        *w = *r++;
+      }
+    }
+    *w = '\0';
+
+    if ((mnt = malloc(sizeof(*mnt))) == NULL ||
+        (mnt->target = strdup(target)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      free(mnt);
+      break;
+    }
+    mnt->major = major;
+    mnt->minor = minor;
+    mnt->next = mnt_root;
+    mnt_root = mnt;
+  }
+
+  fclose(fp);
+  return(mnt_root);
+}
+
+/* free a mount table returned by read_mounts() */
+static void free_mounts(mount_t *mnt)
+{
+  mount_t *next;
+
+  for (; mnt != NULL; mnt = next) {
+    next = mnt->next;
+    free(mnt->target);
+    free(mnt);
+  }
+}
+
+static void count_mount(const char *disk, void *arg)
+{
+  disk_stats_t *ds = get_diskstats(arg, disk);
+
+  if (ds != NULL) {
+    ds->mounts++;
+  }
+}
+
+/* count the filesystems mounted from each disk */
+static void count_mounts(mount_t *mnt, disk_stats_t *ds_root)
+{
+  disk_stats_t *ds;
+
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    ds->mounts = 0;
+  }
+  for (; mnt != NULL; mnt = mnt->next) {
+    dev_disks(mnt->major, mnt->minor, count_mount, ds_root);
+  }
+}
+
+/* Call 'fn' for each whole disk a block device resides on, following
+ * partitions to their disk and stacked devices (device mapper, md) to their
+ * components ("slaves").
+ */
+static void dev_disks(unsigned int major, unsigned int minor,
+                      void (*fn)(const char *disk, void *arg), void *arg)
+{
+  char path[50];
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major, minor);
+  sysfs_disks(path, 0, fn, arg);
+}
+
+static void sysfs_disks(const char *path, int depth,
+                        void (*fn)(const char *disk, void *arg), void *arg)
+{
+  char buf[PATH_MAX];
+  char sub[PATH_MAX + 300];
+  struct dirent *de;
+  DIR *dir;
+  char *s;
+  int slaves = 0;
+
+  if (depth > 8 || realpath(path, buf) == NULL) {
+    return;
+  }
+
+  /* partition: the disk is the parent directory */
+  snprintf(sub, sizeof(sub), "%s/partition", buf);
+  if (access(sub, F_OK) == 0 && (s = strrchr(buf, '/')) != NULL) {
+    *s = '\0';
+  }
+
+  /* stacked device: follow its components */
+  snprintf(sub, sizeof(sub), "%s/slaves", buf);
+  if ((dir = opendir(sub)) != NULL) {
+    while ((de = readdir(dir)) != NULL) {
+      if (*de->d_name != '.') {
+        snprintf(sub, sizeof(sub), "%s/slaves/%s", buf, de->d_name);
+        sysfs_disks(sub, depth + 1, fn, arg);
+        slaves++;
+      }
+    }
+    closedir(dir);
+  }
+
+  if (slaves == 0 && (s = strrchr(buf, '/')) != NULL) {
+    fn(s + 1, arg);
+  }
+}
+
+/* check whether a sysfs directory has any entries besides "." and ".." */
+static int dir_empty(const char *path)
+{
+  struct dirent *de;
+  DIR *dir;
+  int empty = 1;
+
+  if ((dir = opendir(path)) == NULL) {
+    return(1);
+  }
+  while (empty && (de = readdir(dir)) != NULL) {
+    empty = (*de->d_name == '.');
+  }
+  closedir(dir);
+
+  return(empty);
+}
+
+/* check whether a disk or one of its partitions is held by another block
+ * device (device mapper, md, ...)
+ */
+static int has_holders(const char *name)
+{
+  char path[PATH_MAX];
+  struct dirent *de;
+  DIR *dir;
+  int holders;
+
+  snprintf(path, sizeof(path), "%s/%s/holders", SYSFS_BLOCK, name);
+  if ((holders = !dir_empty(path))) {
+    return(holders);
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", SYSFS_BLOCK, name);
+  if ((dir = opendir(path)) == NULL) {
+    return(0);
+  }
+  while (!holders && (de = readdir(dir)) != NULL) {
+    if (!strncmp(de->d_name, name, strlen(name))) {
+      snprintf(path, sizeof(path), "%s/%s/%s/holders", SYSFS_BLOCK, name,
+               de->d_name);
+      holders = !dir_empty(path);
+    }
+  }
+  closedir(dir);
+
+  return(holders);
+}
+
+/* Per-mount flags as reported by statvfs() and their mount() counterparts */
+static const struct {
+  unsigned long st;
+  unsigned long ms;
+} mnt_flags[] = {
+  { ST_RDONLY,     MS_RDONLY },
+  { ST_NOSUID,     MS_NOSUID },
+  { ST_NODEV,      MS_NODEV },
+  { ST_NOEXEC,     MS_NOEXEC },
+  { ST_NOATIME,    MS_NOATIME },
+  { ST_NODIRATIME, MS_NODIRATIME },
+  { ST_RELATIME,   MS_RELATIME },
+  { 0,             0 }
+};
+
+struct atime_arg {
+  const char *disk;
+  int found;
+};
+
+static void atime_match(const char *disk, void *arg)
+{
+  struct atime_arg *aa = arg;
+
+  if (!strcmp(disk, aa->disk)) {
+    aa->found = 1;
+  }
+}
+
+/* Remount all filesystems residing on a disk with "noatime" before stopping
+ * it; reading from the page cache would otherwise still dirty inodes on
+ * relatime/strictatime mounts and the resulting writes would wake up the
+ * disk. This uses bind remounts which only change the per-mount flags, thus
+ * all other flags need to be passed again. Each change is recorded in a
+ * journal in /run first so the original flags can be restored even after a
+ * crash (see atime_replay()).
+ */
+static void atime_suppress(disk_stats_t *ds, mount_t *mnt)
+{
+  for (; mnt != NULL; mnt = mnt->next) {
+    struct atime_arg aa;
+    struct statvfs sv;
+    unsigned long flags = 0;
+    remount_t *rm;
+    int i;
+
+    aa.disk = ds->name;
+    aa.found = 0;
+    dev_disks(mnt->major, mnt->minor, atime_match, &aa);
+    if (!aa.found || statvfs(mnt->target, &sv) < 0 || (sv.f_flag & ST_NOATIME)) {
+      continue;
+    }
+
+    for (i = 0; mnt_flags[i].st != 0; i++) {
+      if (sv.f_flag & mnt_flags[i].st) {
+        flags |= mnt_flags[i].ms;
+      }
+    }
+    if (!(flags & MS_RELATIME)) {
+      flags |= MS_STRICTATIME;
+    }
+
+    if ((rm = malloc(sizeof(*rm))) == NULL ||
+        (rm->disk = strdup(ds->name)) == NULL ||
+        (rm->target = strdup(mnt->target)) == NULL) {
+      fprintf(stderr, "out of memory\n");
+      if (rm != NULL) {
+        free(rm->disk);
+      }
+      free(rm);
+      return;
+    }
+    rm->flags = flags;
+    rm->next = remounts;
+    remounts = rm;
+    atime_journal();
+
+    flags &= ~(MS_RELATIME | MS_STRICTATIME);
+    if (mount(NULL, rm->target, NULL, MS_REMOUNT | MS_BIND | MS_NOATIME | flags,
+              NULL) < 0) {
+      dprintf("%s: can't remount noatime: %s\n", rm->target, strerror(errno));
+    } else {
+      dprintf("%s: remounted noatime\n", rm->target);
+    }
+  }
+}
+
+/* restore the original flags of mounts changed by atime_suppress() for a
+ * disk (or all disks if 'disk' is NULL)
+ */
+static void atime_restore(const char *disk)
+{
+  remount_t **rmp = &remounts;
+  remount_t *rm;
+  int changed = 0;
+
+  while ((rm = *rmp) != NULL) {
+    if (disk != NULL && strcmp(disk, rm->disk)) {
+      rmp = &rm->next;
+      continue;
+    }
+
+    if (mount(NULL, rm->target, NULL, MS_REMOUNT | MS_BIND | rm->flags, NULL) < 0) {
+      dprintf("%s: can't restore mount flags: %s\n", rm->target, strerror(errno));
+    } else {
+      dprintf("%s: mount flags restored\n", rm->target);
+    }
+
+    *rmp = rm->next;
+    free(rm->disk);
+    free(rm->target);
+    free(rm);
+    changed = 1;
+  }
+
+  if (changed) {
+    atime_journal();
+  }
+}
+
+/* Write the list of changed mounts to the journal (or remove the journal if
+ * there are none). The journal is written to a temporary file and renamed to
+ * make sure it's never incomplete. Lines consist of the original flags in
+ * hex, the disk and the mount point.
+ */
+static void atime_journal(void)
+{
+  char tmp[sizeof(ATIME_JOURNAL) + 4];
+  remount_t *rm;
+  FILE *fp;
+
+  if (remounts == NULL) {
+    if (unlink(ATIME_JOURNAL) < 0 && errno != ENOENT) {
+      perror(ATIME_JOURNAL);
+    }
+    return;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.new", ATIME_JOURNAL);
+  mkdir(RUN_DIR, 0755);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
+    return;
+  }
+  for (rm = remounts; rm != NULL; rm = rm->next) {
+    fprintf(fp, "%lx %s %s\n", rm->flags, rm->disk, rm->target);
+  }
+  if (fclose(fp) != 0 || rename(tmp, ATIME_JOURNAL) < 0) {
+    perror(ATIME_JOURNAL);
+  }
+}
+
+/* restore mounts recorded in the journal by a previous instance */
+static void atime_replay(void)
+{
+  char buf[PATH_MAX + 100];
+  char disk[50];
+  FILE *fp;
+  unsigned long flags;
+  int pos;
+
+  if ((fp = fopen(ATIME_JOURNAL, "r")) == NULL) {
+    return;
+  }
+
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    buf[strcspn(buf, "\n")] = '\0';
+    if (sscanf(buf, "%lx %49s %n", &flags, disk, &pos) != 2) {
+      continue;
+    }
+    if (mount(NULL, buf + pos, NULL, MS_REMOUNT | MS_BIND | flags, NULL) < 0) {
+      dprintf("%s: can't restore mount flags: %s\n", buf + pos, strerror(errno));
+    } else {
+      dprintf("%s: mount flags restored from journal\n", buf + pos);
+    }
+  }
+
+  fclose(fp);
+  unlink(ATIME_JOURNAL);
+}
+
+/* become a daemon */
+static void daemonize(void)
+{
+  int i;
+
+  /* fork #1: exit parent process and continue in the background */
+  if ((i = fork()) < 0) {
+    perror("couldn't fork");
+    exit(2);
+  } else if (i > 0) {
+    _exit(0);
+  }
+
+  /* fork #2: detach from terminal and fork again so we can never regain
+   * access to the terminal */
+  setsid();
+  if ((i = fork()) < 0) {
+    perror("couldn't fork #2");
+    exit(2);
+  } else if (i > 0) {
+    _exit(0);
+  }
+
+  /* change to root directory and close file descriptors */
+  chdir("/");
+  close_fds(0);
+
+  /* use /dev/null for stdin, stdout and stderr */
+  open("/dev/null", O_RDONLY);
+  open("/dev/null", O_WRONLY);
+  open("/dev/null", O_WRONLY);
+}
+
+/* Close all file descriptors starting with 'lowfd'. With systemd's
+ * LimitNOFILE, getdtablesize() may return millions, thus try close_range()
+ * (Linux 5.9) first, then the list of open descriptors in /proc/self/fd and
+ * only then fall back to closing each possible descriptor.
+ */
+static void close_fds(int lowfd)
+{
+  DIR *dir;
+  int maxfd;
+  int i;
+
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, (unsigned int) lowfd, ~0U, 0) == 0) {
+    return;
+  }
+#endif
+
+  if ((dir = opendir("/proc/self/fd")) != NULL) {
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      if (isdigit((unsigned char) *de->d_name) &&
+          (i = atoi(de->d_name)) >= lowfd && i != dirfd(dir)) {
+        close(i);
+      }
+    }
+    closedir(dir);
+    return;
+  }
+
+  maxfd = getdtablesize();
+  for (i = lowfd; i < maxfd; i++) {
+    close(i);
+  }
+}
+
+/* get DISKSTATS entry by name of disk */
+static disk_stats_t *get_diskstats(disk_stats_t *ds, const char *name)
+{
+  for (; ds != NULL; ds = ds->next) {
+    if (!strcmp(ds->name, name)) {
+      return(ds);
+    }
+  }
+
+  return(NULL);
+}
+
+/* spin-down a disk */
+static int spindown_disk(const char *name, const quirk_t *q)
+{
+  unsigned char cdb[16];
+
+  dprintf("spindown: %s\n", name);
+
+  memset(cdb, 0x00, sizeof(cdb));
+  if (q != NULL && (q->flags & Q_ATA_STANDBY)) {
+    /* ATA PASS-THROUGH (16), non-data: STANDBY IMMEDIATE */
+    cdb[0] = 0x85;
+    cdb[1] = 3 << 1;
+    cdb[14] = 0xe0;
+    return(sg_command(name, cdb, 16, NULL, 0, q->timeout));
+  }
+
+  /* SCSI stop unit command */
+  cdb[0] = 0x1b;
+  cdb[1] = (q != NULL && (q->flags & Q_IMMED)) ? 0x01 : 0x00;
+  return(sg_command(name, cdb, 6, NULL, 0, (q != NULL) ? q->timeout : 0));
+}
+
+/* spin-up a disk */
+static int start_disk(const char *name, const quirk_t *q)
+{
+  dprintf("start: %s\n", name);
+
+  /* SCSI start unit command */
+  return(sg_command(name, (const unsigned char *) "\x1b\x00\x00\x00\x01\x00", 6,
+                    NULL, 0, (q != NULL) ? q->timeout : 0));
+}
+
+/* Put a disk into an idle power condition (IDLE_B or IDLE_C) with START STOP
+ * UNIT; it leaves this state on its own when the next command arrives
+ */
+static int idle_disk(const char *name, int ps, const quirk_t *q)
+{
+  unsigned char cdb[6];
+
+  dprintf("idle: %s %s\n", name, ps_names[ps]);
+
+  memset(cdb, 0x00, sizeof(cdb));
+  cdb[0] = 0x1b;
+  cdb[1] = (q != NULL && (q->flags & Q_IMMED)) ? 0x01 : 0x00;
+  cdb[3] = (ps == PS_IDLE_B) ? 0x01 : 0x02;  /* power condition modifier */
+  cdb[4] = 0x02 << 4;                         /* power condition: IDLE */
+  return(sg_command(name, cdb, 6, NULL, 0, (q != NULL) ? q->timeout : 0));
+}
+
+/* Pick the deepest power state whose exit latency fits into the disk's wake
+ * latency budget (if any); returns -1 if none does
+ */
+static int pick_pstate(disk_stats_t *ds)
+{
+  int ps;
+
+  if (ds->latency < 0) {
+    return(PS_STANDBY);
+  }
+  for (ps = PS_MAX - 1; ps >= 0; ps--) {
+    if (ds->exit_ms[ps] >= 0 && ds->exit_ms[ps] <= ds->latency) {
+      return(ps);
+    }
+  }
+  return(-1);
+}
+
+/* Learn the exit latency of the power state a disk has just left. The busy
+ * time (io_ticks) of the polling interval includes the time the first
+ * request waited for the disk, but also any other I/O, thus it's only an
+ * upper bound. It's capped at PS_CAP times the default and averaged with
+ * the default and earlier wakes (EWMA with a weight of 1/4), so a busy
+ * interval can't push the estimate far off.
+ */
+static void learn_pstate(disk_stats_t *ds, unsigned int ticks, time_t secs)
+{
+  int ps = (int) ds->pstate;
+  int ms;
+
+  if (ds->exit_ms[ps] < 0 || ticks == 0) {
+    return;
+  }
+  ms = (secs > 0 && ticks > (unsigned int) secs * 1000) ? (int) secs * 1000 : (int) ticks;
+  if (ms > PS_CAP * ps_exit_ms[ps]) {
+    ms = PS_CAP * ps_exit_ms[ps];
+  }
+  ds->exit_ms[ps] = (3 * ds->exit_ms[ps] + ms) / 4;
+  dprintf("%s: woke up from %s within %d ms, exit latency now %d ms\n", ds->name,
+          ps_names[ps], ms, ds->exit_ms[ps]);
+}
+
+/* execute a SCSI command, reading up to 'data_len' bytes into 'data' unless
+ * it's NULL; 'timeout' is in ms (0: kernel default); returns 0 on success,
+ * SG_REJECTED if the device reports ILLEGAL REQUEST with INVALID COMMAND
+ * OPERATION CODE or INVALID FIELD IN CDB and -1 on any other error
+ */
+static int sg_command(const char *name, const unsigned char *cdb, int cdb_len,
+                      unsigned char *data, int data_len, int timeout)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char sense_buf[255];
+  char dev_name[100];
+  int rc = -1;
+  int fd;
+
+  /* fabricate SCSI IO request */
+  memset(&io_hdr, 0x00, sizeof(io_hdr));
+  io_hdr.interface_id = 'S';
+  io_hdr.dxfer_direction = (data != NULL) ? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+  io_hdr.dxferp = data;
+  io_hdr.dxfer_len = (unsigned int) data_len;
+  io_hdr.timeout = (unsigned int) timeout;
+  io_hdr.cmdp = (unsigned char *) cdb;
+  io_hdr.cmd_len = (unsigned char) cdb_len;
+  io_hdr.sbp = sense_buf;
+  io_hdr.mx_sb_len = (unsigned char) sizeof(sense_buf);
+
+  /* open disk device (kernel 2.4 will probably need "sg" names here) */
+  snprintf(dev_name, sizeof(dev_name), "/dev/%s", name);
+  if ((fd = open(dev_name, O_RDONLY)) < 0) {
+    perror(dev_name);
+    return(-1);
+  }
+
+  /* execute SCSI request */
+  if (ioctl(fd, SG_IO, &io_hdr) < 0) {
+    char buf[100];
+    snprintf(buf, sizeof(buf), "ioctl on %s:", name);
+    perror(buf);
+
+  } else if (io_hdr.masked_status != 0) {
+    fprintf(stderr, "error: SCSI command failed with status 0x%02x\n",
+            io_hdr.masked_status);
+    if (io_hdr.masked_status == CHECK_CONDITION) {
+      int key = -1;
+      int asc = -1;
+
+      phex(stderr, sense_buf, io_hdr.sb_len_wr, "sense buffer:\n");
+      if ((sense_buf[0] & 0x7e) == 0x70 && io_hdr.sb_len_wr >= 13) {
+        /* fixed format */
+        key = sense_buf[2] & 0x0f;
+        asc = sense_buf[12];
+      } else if ((sense_buf[0] & 0x7e) == 0x72 && io_hdr.sb_len_wr >= 3) {
+        /* descriptor format */
+        key = sense_buf[1] & 0x0f;
+        asc = sense_buf[2];
+      }
+      if (key == 0x05 && (asc == 0x20 || asc == 0x24)) {
+        rc = SG_REJECTED;
+      }
+    }
+
+  } else {
+    rc = 0;
+  }
+
+  close(fd);
+  return(rc);
+}
+
+/* write a spin-up event message to the log file */
+static void log_spinup(const char *logfile, disk_stats_t *ds)
+{
+  FILE *fp;
+
+  if ((fp = fopen(logfile, "a")) != NULL) {
+    setvbuf(fp, NULL, _IOLBF, 0); /* line buffer */
+    /* Print statistics to logfile
+     *
+     * Note: This doesn't work too well if there are multiple disks
+     *       because the I/O we're dealing with might be on another
+     *       disk so we effectively wake up the disk the log file is
+     *       stored on as well. Then again the logfile is a debugging
+     *       option, so what...
+     */
+    time_t now = time(NULL);
+    char tstr[20];
+    char dstr[20];
+
+    strftime(dstr, sizeof(dstr), "%Y-%m-%d", localtime(&now));
+    strftime(tstr, sizeof(tstr), "%H:%M:%S", localtime(&now));
+    fprintf(fp,
+            "date: %s, time: %s, disk: %s, running: %ld, stopped: %ld\n",
+            dstr, tstr, ds->name,
+            (long) ds->spindown - (long) ds->spinup,
+            (long) time(NULL) - (long) ds->spindown);
+
+    /* Sync to make sure writing to the logfile won't cause another
+     * spinup in 30 seconds (or whatever bdflush uses as flush interval).
+     */
+    fclose(fp);
+
+    /* Don't be slow shutting down */
+    if (!break_loop) {
+      sleep(1);
+      if (!break_loop)
+        sync();
+    }
+  }
+}
+
+/* Resolve disk names specified as "/dev/disk/by-xxx" or some other symlink.
+ * Please note that this function is only called during command line parsing
+ * and hd-idle per se does not support dynamic disk additions or removals at
+ * runtime.
+ *
+ * This might change in the future but would require some fiddling to avoid
+ * needless overhead -- after all, this was designed to run on tiny embedded
+ * devices, too.
+ */
+static char *disk_name(char *path)
+{
+  char buf[PATH_MAX + 1];
+  char *s;
+
+  if (*path != '/') {
+    /* just a disk name without /dev prefix */
+    return(path);
+  }
+
+  if (realpath(path, buf) == NULL) {
+    char errmsg[PATH_MAX + 20];
+    snprintf(errmsg, sizeof(errmsg), "realpath(%s)", path);
+    perror(errmsg);
+    return(path);
+  }
+
+  /* remove partition numbers, if any */
+  for (s = buf + strlen(buf) - 1; s >= buf && isdigit(*s); s--) {
+    *s = '\0';
+  }
+
+  /* Extract basename of the disk in /dev. Note that this assumes that the
+   * final target of the symlink (if any) resolves to /dev/sd*
+   */
+  if ((s = strrchr(buf, '/')) != NULL) {
+    s++;
+  } else {
+    s = buf;
+  }
+
+  if ((s = strdup(s)) == NULL) {
+    fprintf(stderr, "out of memory");
+    exit(2);
+  }
+
+  dprintf("using %s for %s\n", s, path);
+  return(s);
+}
+
+/* print hex dump to stderr (e.g. sense buffers) */
+static void phex(FILE *fp, const void *p, int len, const char *fmt, ...)
+{
+  va_list va;
+  const unsigned char *buf = p;
+  int pos = 0;
+  int i;
+
+  /* print header */
+  va_start(va, fmt);
+  vfprintf(fp, fmt, va);
+
+  /* print hex block */
+  while (len > 0) {
+    fprintf(fp, "%08x ", pos);
+
+    /* print hex block */
+    for (i = 0; i < 16; i++) {
+      if (i < len) {
+        fprintf(fp, "%c%02x", ((i == 8) ? '-' : ' '), buf[i]);
+      } else {
+        fprintf(fp, "   ");
+      }
+    }
+
+    /* print ASCII block */
+    fprintf(fp, "   ");
+    for (i = 0; i < ((len > 16) ? 16 : len); i++) {
+      fprintf(fp, "%c", (buf[i] >= 32 && buf[i] < 128) ? buf[i] : '.');
+    }
+    fprintf(fp, "\n");
+
+    pos += 16;
+    buf += 16;
+    len -= 16;
+  }
+}
+
+/* make sure this is a SCSI disk (sd[a-z]*) and a whole disk (not partition);
+ * the sd driver uses majors 8, 65-71 and 128-135 with 16 minors per disk
+ */
+static int is_scsi_disk(unsigned int major, unsigned int minor)
+{
+  return (major == 8 || (major >= 65 && major <= 71) ||
+          (major >= 128 && major <= 135)) && (minor % 16 == 0);
+}
+
+/* Set up the systemd notification socket ($NOTIFY_SOCKET, an AF_UNIX datagram
+ * socket; names starting with '@' are in the abstract namespace). This speaks
+ * the sd_notify() protocol directly to avoid depending on libsystemd. Returns
+ * the interval in seconds in which watchdog keep-alive messages are expected
+ * (half of $WATCHDOG_USEC) or 0 if the watchdog is disabled.
+ */
+static int notify_init(void)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  const char *s;
+  long usec;
+
+  if (path == NULL || (*path != '/' && *path != '@') ||
+      strlen(path) >= sizeof(notify_addr.sun_path)) {
+    return(0);
+  }
+
+  if ((notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket(AF_UNIX)");
+    return(0);
+  }
+
+  memset(&notify_addr, 0x00, sizeof(notify_addr));
+  notify_addr.sun_family = AF_UNIX;
+  strcpy(notify_addr.sun_path, path);
+  if (*path == '@') {
+    notify_addr.sun_path[0] = '\0';
+  }
+  notify_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+  if ((s = getenv("WATCHDOG_PID")) != NULL && atol(s) != (long) getpid()) {
+    return(0);
+  }
+  if ((s = getenv("WATCHDOG_USEC")) == NULL || (usec = atol(s)) <= 0) {
+    return(0);
+  }
+
+  dprintf("systemd watchdog: %ld us\n", usec);
+  return((usec / 2000000L > 0) ? (int) (usec / 2000000L) : 1);
+}
+
+/* send a notification message to systemd (if running under systemd) */
+static void notify(const char *fmt, ...)
+{
+  char buf[200];
+  va_list va;
+  int len;
+
+  if (notify_fd < 0) {
+    return;
+  }
+
+  va_start(va, fmt);
+  len = vsnprintf(buf, sizeof(buf), fmt, va);
+  va_end(va);
+
+  if (sendto(notify_fd, buf, (len < (int) sizeof(buf)) ? len : (int) sizeof(buf) - 1,
+             MSG_NOSIGNAL, (struct sockaddr *) &notify_addr, notify_len) < 0) {
+    perror("sendto($NOTIFY_SOCKET)");
+  }
+}
+
+/* get microseconds elapsed on clock 'clk' since 'since' */
+static long elapsed_us(clockid_t clk, const struct timespec *since)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return((long) (ts.tv_sec - since->tv_sec) * 1000000L +
+         (ts.tv_nsec - since->tv_nsec) / 1000L);
+}
+
+/* get the current time in ns (CLOCK_MONOTONIC) */
+static long long mono_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((long long) ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/* Add a value (in us) to a histogram. Bucket i counts values from 2^i to
+ * 2^(i+1)-1 us (bucket 0 also counts 0), the last bucket anything above,
+ * thus recording costs a few instructions only.
+ */
+static void hist_add(histogram_t *h, long long us)
+{
+  unsigned long long v = (us > 0) ? (unsigned long long) us : 0;
+  int i = (v < 2) ? 0 : 63 - __builtin_clzll(v);
+
+  h->bucket[(i < HIST_BUCKETS) ? i : HIST_BUCKETS - 1]++;
+  h->count++;
+  h->sum += v;
+  if (v > h->max) {
+    h->max = (unsigned long) v;
+  }
+}
+
+/* print the histograms in human readable form */
+static void hist_dump(FILE *fp)
+{
+  histogram_t *h;
+  int i;
+
+  for (h = hists; h < hists + H_MAX; h++) {
+    if (h->count == 0) {
+      continue;
+    }
+    fprintf(fp, "%s: count %lu, avg %llu us, max %lu us\n", h->name, h->count,
+            h->sum / h->count, h->max);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+      if (h->bucket[i] != 0) {
+        fprintf(fp, "  < %llu us: %lu\n", 2ULL << i, h->bucket[i]);
+      }
+    }
+  }
+  fflush(fp);
+}
+
+/* write the histograms to a file in Prometheus' text format */
+static void hist_metrics(const char *path)
+{
+  char tmp[PATH_MAX];
+  histogram_t *h;
+  FILE *fp;
+  int i;
+
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    perror(tmp);
+    return;
+  }
+  fprintf(fp, "# HELP hd_idle_loop_microseconds Timing of hd-idle's main loop\n"
+              "# TYPE hd_idle_loop_microseconds histogram\n");
+  for (h = hists; h < hists + H_MAX; h++) {
+    unsigned long n = 0;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+      n += h->bucket[i];
+      fprintf(fp, "hd_idle_loop_microseconds_bucket{phase=\"%s\",le=\"%llu\"} %lu\n",
+              h->name, (2ULL << i) - 1, n);
+    }
+    fprintf(fp, "hd_idle_loop_microseconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n",
+            h->name, h->count);
+    fprintf(fp, "hd_idle_loop_microseconds_sum{phase=\"%s\"} %llu\n", h->name, h->sum);
+    fprintf(fp, "hd_idle_loop_microseconds_count{phase=\"%s\"} %lu\n", h->name,
+            h->count);
+  }
+  if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+    perror(path);
+  }
+}
+
+/* get the wall clock time in microseconds */
+static long long real_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return((long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+/* Open the timeline trace ("-j"), a Chrome/Perfetto JSON trace with a track
+ * per disk. The trailing "]" of the event array is optional in this format,
+ * thus events can simply be appended and the file can be opened in a trace
+ * viewer (e.g. ui.perfetto.dev) while hd-idle is running.
+ */
+static int trace_open(const char *path)
+{
+  if ((trace_fp = fopen(path, "w")) == NULL) {
+    perror(path);
+    return(-1);
+  }
+  trace_pid = (int) getpid();
+  fprintf(trace_fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,"
+          "\"args\":{\"name\":\"hd-idle\"}},\n", trace_pid);
+  return(0);
+}
+
+/* end the tracks of all disks and terminate the event array */
+static void trace_close(disk_stats_t *ds_root)
+{
+  disk_stats_t *ds;
+
+  if (trace_fp == NULL) {
+    return;
+  }
+  for (ds = ds_root; ds != NULL; ds = ds->next) {
+    trace_end(ds);
+  }
+  fprintf(trace_fp, "{\"name\":\"exit\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%lld,"
+          "\"pid\":%d,\"tid\":0}\n]\n", real_us(), trace_pid);
+  if (fclose(trace_fp) != 0) {
+    perror("trace");
+  }
+  trace_fp = NULL;
+}
+
+/* write an event to a disk's track; 'fmt' adds further members, if any */
+static void trace_event(disk_stats_t *ds, int ph, const char *name,
+                        long long ts, const char *fmt, ...)
+{
+  va_list va;
+
+  if (ts < ds->trace_ts) {
+    /* keep the events of a track in order */
+    ts = ds->trace_ts;
+  }
+  fprintf(trace_fp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+          name, ph, ts, trace_pid, ds->trace_tid);
+  if (fmt != NULL) {
+    fputc(',', trace_fp);
+    va_start(va, fmt);
+    vfprintf(trace_fp, fmt, va);
+    va_end(va);
+  }
+  fputs("},\n", trace_fp);
+  ds->trace_ts = ts;
+}
+
+/* start the track of a new disk, which is assumed to be spinning */
+static void trace_start(disk_stats_t *ds)
+{
+  if (trace_fp == NULL || ds->trace_tid != 0) {
+    return;
+  }
+  ds->trace_tid = ++trace_tids;
+  ds->trace_ts = 0;
+  trace_event(ds, 'M', "thread_name", 0, "\"args\":{\"name\":\"%s\"}", ds->name);
+  trace_event(ds, 'B', ds->spun_down ? "stopped" : "spinning", real_us(), NULL);
+}
+
+/* end the track of a disk which has been removed (or on exit) */
+static void trace_end(disk_stats_t *ds)
+{
+  if (trace_fp == NULL || ds->trace_tid == 0) {
+    return;
+  }
+  trace_event(ds, 'E', ds->spun_down ? "stopped" : "spinning", real_us(), NULL);
+  ds->trace_tid = 0;
+}
+
+/* A disk has been spun down by a command which took 'us' microseconds, or by
+ * the kernel (us == 0).
+ */
+static void trace_stop(disk_stats_t *ds, long long us, int rc)
+{
+  long long ts;
+
+  if (trace_fp == NULL || ds->trace_tid == 0) {
+    return;
+  }
+  ts = real_us();
+  trace_event(ds, 'E', "spinning", ts - us, NULL);
+  if (us > 0) {
+    trace_event(ds, 'X', "spin-down", ts - us, "\"dur\":%lld,\"args\":{\"rc\":%d}",
+                us, rc);
+  }
+  trace_event(ds, 'B', "stopped", ts, NULL);
+}
+
+/* A disk has spun up some time since the previous poll; the spin-up slice
+ * covers that interval because the exact time isn't known.
+ */
+static void trace_wake(disk_stats_t *ds)
+{
+  long long ts;
+  long long since;
+
+  if (trace_fp == NULL || ds->trace_tid == 0) {
+    return;
+  }
+  ts = real_us();
+  since = (long long) ds->last_poll * 1000000LL;
+  if (since < ds->trace_ts) {
+    since = ds->trace_ts;
+  }
+  trace_event(ds, 'E', "stopped", since, NULL);
+  trace_event(ds, 'X', "spin-up", since, "\"dur\":%lld,\"args\":{\"stopped_s\":%ld}",
+              (ts > since) ? ts - since : 0, (long) (ds->last_poll - ds->spindown));
+  trace_event(ds, 'B', "spinning", ts, NULL);
+}
+
+/* Add the I/O rate since the previous poll to a disk's counter track. Polls
+ * without I/O are only recorded when the rate drops to zero, which keeps the
+ * trace of mostly idle disks small.
+ */
+static void trace_io(disk_stats_t *ds, unsigned int reads, unsigned int writes,
+                     time_t secs)
+{
+  char name[sizeof(ds->name) + 8];
+
+  if (trace_fp == NULL || ds->trace_tid == 0 ||
+      (reads == 0 && writes == 0 && !ds->trace_busy)) {
+    return;
+  }
+  if (secs < 1) {
+    secs = 1;
+  }
+  snprintf(name, sizeof(name), "%s I/O/s", ds->name);
+  trace_event(ds, 'C', name, real_us(), "\"args\":{\"reads\":%.2f,\"writes\":%.2f}",
+              (double) reads / secs, (double) writes / secs);
+  ds->trace_busy = (reads != 0 || writes != 0);
+}
+
+/* Open (or create) the activity history ("-o"), a round-robin database with
+ * fixed-size archives per disk: a row per minute for a day and a row per
+ * hour for a year, each with the I/O operations, sectors and seconds spun
+ * down. The file has a fixed size (see RRD_DISKS) and is mapped into memory,
+ * thus updates are mere additions and the kernel writes them back. Rows are
+ * identified by their slot (minutes or hours since the epoch) so stale rows
+ * are recognized and recycled without a sweep. A history of an older version
+ * or a different layout is reset, but anything without the magic number is
+ * left alone lest a typo in the path wipes an unrelated file.
+ */
+static int rrd_open(const char *path)
+{
+  struct stat st;
+  uint32_t hdr[5];
+  void *p;
+  int fd;
+
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return(-1);
+  }
+  if (st.st_size > 0) {
+    /* magic, version, disks, minutes, hours */
+    if (pread(fd, hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) || hdr[0] != RRD_MAGIC) {
+      fprintf(stderr, "%s: not an activity history, not touching it\n", path);
+      close(fd);
+      return(-1);
+    }
+    if (hdr[1] > RRD_VERSION) {
+      fprintf(stderr, "%s: activity history of a newer version (%u)\n", path,
+              (unsigned int) hdr[1]);
+      close(fd);
+      return(-1);
+    }
+    if (hdr[1] != RRD_VERSION || hdr[2] != RRD_DISKS || hdr[3] != RRD_MINUTES ||
+        hdr[4] != RRD_HOURS || st.st_size != (off_t) sizeof(*rrd)) {
+      fprintf(stderr, "%s: activity history of version %u or a different layout, "
+              "starting a new history\n", path, (unsigned int) hdr[1]);
+      st.st_size = 0;
+    }
+  }
+  if (st.st_size == 0 && (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(*rrd)) < 0)) {
+    perror(path);
+    close(fd);
+    return(-1);
+  }
+  p = mmap(NULL, sizeof(*rrd), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return(-1);
+  }
+  rrd = p;
+
+  if (rrd->magic == 0) {
+    /* a new file is all zeroes already (and mostly unallocated) */
+    rrd->magic = RRD_MAGIC;
+    rrd->version = RRD_VERSION;
+    rrd->disks = RRD_DISKS;
+    rrd->minutes = RRD_MINUTES;
+    rrd->hours = RRD_HOURS;
+  }
+  dprintf("history: %s, %lu KiB for %d disks\n", path,
+          (unsigned long) sizeof(*rrd) / 1024, RRD_DISKS);
+  return(0);
+}
+
+static void rrd_close(void)
+{
+  if (rrd != NULL) {
+    munmap(rrd, sizeof(*rrd));
+    rrd = NULL;
+  }
+}
+
+/* find a disk's archives by name or assign the first unused ones */
+static void rrd_attach(disk_stats_t *ds)
+{
+  rrd_disk_t *d;
+  rrd_disk_t *unused = NULL;
+
+  if (rrd == NULL) {
+    return;
+  }
+  for (d = rrd->disk; d < rrd->disk + RRD_DISKS; d++) {
+    if (!strcmp(d->name, ds->name)) {
+      ds->rrd = d;
+      return;
+    }
+    if (unused == NULL && *d->name == '\0') {
+      unused = d;
+    }
+  }
+  if (unused == NULL) {
+    dprintf("%s: no room in history\n", ds->name);
+    return;
+  }
+  snprintf(unused->name, sizeof(unused->name), "%s", ds->name);
+  ds->rrd = unused;
+}
+
+/* Account the I/O of a poll and, if the disk was spun down, the time since
+ * the previous poll. All of it goes to the current minute and hour.
+ */
+static void rrd_update(disk_stats_t *ds, unsigned int ops, unsigned int sectors,
+                       time_t now)
+{
+  unsigned int secs = (now > ds->last_poll) ? (unsigned int) (now - ds->last_poll) : 0;
+  unsigned int stopped = ds->spun_down ? secs : 0;
+
+  if (ds->rrd == NULL) {
+    return;
+  }
+  if (ops == 0 && stopped == 0) {
+    return;
+  }
+  rrd_add(&ds->rrd->minute[(now / 60) % RRD_MINUTES], (uint32_t) (now / 60),
+          ops, sectors, stopped);
+  rrd_add(&ds->rrd->hour[(now / 3600) % RRD_HOURS], (uint32_t) (now / 3600),
+          ops, sectors, stopped);
+  if (ops > 0) {
+    /* I/O on a stopped disk means it has spun up */
+    heat_add(&ds->rrd->heat[hour_of_week(now)], now, secs, ds->spun_down);
+  }
+}
+
+/* add to a row, recycling it if it belongs to an earlier slot */
+static void rrd_add(rrd_row_t *row, uint32_t slot, unsigned int ops,
+                    unsigned int sectors, unsigned int stopped)
+{
+  if (row->slot != slot) {
+    row->slot = slot;
+    row->ops = row->sectors = row->stopped = 0;
+  }
+  row->ops += ops;
+  row->sectors += sectors;
+  row->stopped += stopped;
+}
+
+/* map a history file read-only for printing it */
+static const rrd_t *rrd_map(const char *path)
+{
+  const rrd_t *r;
+  struct stat st;
+  void *p;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return(NULL);
+  }
+  if (st.st_size != (off_t) sizeof(*r)) {
+    fprintf(stderr, "%s: not an activity history of this version\n", path);
+    close(fd);
+    return(NULL);
+  }
+  p = mmap(NULL, sizeof(*r), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    perror(path);
+    return(NULL);
+  }
+  r = p;
+  if (r->magic != RRD_MAGIC || r->version != RRD_VERSION || r->disks != RRD_DISKS ||
+      r->minutes != RRD_MINUTES || r->hours != RRD_HOURS) {
+    fprintf(stderr, "%s: not an activity history of this version\n", path);
+    munmap(p, sizeof(*r));
+    return(NULL);
+  }
+  return(r);
+}
+
+/* print the activity history ("-O"), followed by the raw heatmaps */
+static int rrd_dump(const char *path)
+{
+  static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  const rrd_t *r;
+  const rrd_disk_t *d;
+  time_t now = time(NULL);
+  int i;
+
+  if ((r = rrd_map(path)) == NULL) {
+    return(-1);
+  }
+
+  printf("# disk\tperiod\tstart\tops\tsectors\tstopped\n");
+  for (d = r->disk; d < r->disk + RRD_DISKS; d++) {
+    if (*d->name == '\0') {
+      continue;
+    }
+    rrd_print(d, "minute", d->minute, RRD_MINUTES, (uint32_t) (now / 60), 60);
+    rrd_print(d, "hour", d->hour, RRD_HOURS, (uint32_t) (now / 3600), 3600);
+  }
+
+  printf("# disk\thour of week\tactive\tspinups\n");
+  for (d = r->disk; d < r->disk + RRD_DISKS; d++) {
+    for (i = 0; *d->name != '\0' && i < HEAT_HOURS; i++) {
+      const rrd_heat_t *h = &d->heat[i];
+      double f = heat_decay(h->week, now);
+      if (h->active * f >= 0.5 || h->spinups * f >= 0.005) {
+        printf("%s\t%s %02d\t%.0f\t%.2f\n", d->name, days[i / 24], i % 24,
+               h->active * f, h->spinups * f);
+      }
+    }
+  }
+  munmap((void *) r, sizeof(*r));
+  return(0);
+}
+
+/* print the rows of an archive which are within its time span, oldest first */
+static void rrd_print(const rrd_disk_t *d, const char *period,
+                      const rrd_row_t *rows, int n, uint32_t last, int secs)
+{
+  char buf[32];
+  uint32_t slot;
+  time_t t;
+
+  for (slot = last - (uint32_t) n + 1; slot != last + 1; slot++) {
+    const rrd_row_t *row = &rows[slot % (uint32_t) n];
+    if (row->slot != slot) {
+      continue;
+    }
+    t = (time_t) slot * secs;
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("%s\t%s\t%s\t%u\t%u\t%u\n", d->name, period, buf, row->ops,
+           row->sectors, row->stopped);
+  }
+}
+
+/* Add to an hour-of-week bucket. Buckets decay lazily: the value is scaled
+ * down for the weeks passed since its last update before adding to it, thus
+ * an update costs the same no matter how many buckets there are.
+ */
+static void heat_add(rrd_heat_t *h, time_t now, unsigned int active,
+                     unsigned int spinups)
+{
+  double f = heat_decay(h->week, now);
+
+  h->active = (float) (h->active * f + active);
+  h->spinups = (float) (h->spinups * f + spinups);
+  h->week = (uint32_t) (now / (7 * 86400L));
+}
+
+/* get the factor by which a bucket last updated in 'week' has decayed */
+static double heat_decay(uint32_t week, time_t now)
+{
+  uint32_t weeks = (uint32_t) (now / (7 * 86400L)) - week;
+  double f = 1.0;
+
+  if (week == 0) {
+    return(1.0);
+  }
+  if (weeks > 128) {
+    /* less than a billionth left */
+    return(0.0);
+  }
+  while (weeks-- > 0) {
+    f *= HEAT_DECAY;
+  }
+  return(f);
+}
+
+/* get the hour of the week in local time (0 is Sunday, 0:00) */
+static int hour_of_week(time_t t)
+{
+  static time_t last = -1;
+  static int how;
+  struct tm tm;
+
+  if (t != last) {
+    localtime_r(&t, &tm);
+    how = tm.tm_wday * 24 + tm.tm_hour;
+    last = t;
+  }
+  return(how);
+}
+
+/* print the hour-of-week heatmaps of a history ("-H") */
+static int heat_dump(const char *path)
+{
+  const rrd_t *r;
+  const rrd_disk_t *d;
+  time_t now = time(NULL);
+
+  if ((r = rrd_map(path)) == NULL) {
+    return(-1);
+  }
+  for (d = r->disk; d < r->disk + RRD_DISKS; d++) {
+    if (*d->name != '\0') {
+      heat_print(d, "activity", 0, now);
+      heat_print(d, "spin-ups", 1, now);
+    }
+  }
+  munmap((void *) r, sizeof(*r));
+  return(0);
+}
+
+/* print a disk's heatmap of activity or spin-ups, scaled to its maximum */
+static void heat_print(const rrd_disk_t *d, const char *what, int spinups,
+                       time_t now)
+{
+  static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char shades[] = " .:-=+*#%@";
+  double v[HEAT_HOURS];
+  double max = 0;
+  int i;
+
+  for (i = 0; i < HEAT_HOURS; i++) {
+    const rrd_heat_t *h = &d->heat[i];
+    v[i] = (spinups ? h->spinups : h->active) * heat_decay(h->week, now);
+    if (v[i] > max) {
+      max = v[i];
+    }
+  }
+
+  printf("%s %s (max %.*f per hour)\n   ", d->name, what, spinups ? 2 : 0, max);
+  for (i = 0; i < 24; i++) {
+    printf("%3d", i);
+  }
+  for (i = 0; i < HEAT_HOURS; i++) {
+    int shade = 0;
+    if (i % 24 == 0) {
+      printf("\n%s", days[i / 24]);
+    }
+    if (v[i] > 0 && max > 0) {
+      /* anything above zero gets at least the lightest shade */
+      shade = 1 + (int) (v[i] / max * (sizeof(shades) - 3));
+    }
+    printf("  %c", shades[shade]);
+  }
+  printf("\n\n");
+}
+
+/* Look up the io.stat file of a cgroup (v2) whose I/O shall be ignored. The
+ * path may be absolute or relative to the cgroup mount point, e.g.
+ * "system.slice/backup.service". The file is opened after daemonizing (see
+ * read_cgroups()) and kept open to avoid path lookups in the main loop. The
+ * cgroup needn't exist yet: systemd creates a service's cgroup when the
+ * service starts and removes it when it stops.
+ */
+static cgroup_t *open_cgroup(const char *path)
+{
+  char fname[PATH_MAX];
+  cgroup_t *cg;
+
+  if (*path == '/') {
+    snprintf(fname, sizeof(fname), "%s/io.stat", path);
+  } else {
+    snprintf(fname, sizeof(fname), "%s/%s/io.stat", CGROUP_ROOT, path);
+  }
+
+  if ((cg = malloc(sizeof(*cg))) == NULL || (cg->path = strdup(fname)) == NULL) {
+    fprintf(stderr, "out of memory\n");
+    free(cg);
+    return(NULL);
+  }
+  cg->next = NULL;
+  cg->fd = -1;
+  cg->present = 0;
+
+  dprintf("ignoring I/O from %s%s\n", fname,
+          (access(fname, R_OK) < 0) ? " (doesn't exist yet)" : "");
+  return(cg);
+}
+
+/* Read io.stat of all ignored cgroups and sum up their per-device read and
+ * write operations in 'cg_io'. Lines look like this:
+ *
+ *   8:16 rbytes=1459200 wbytes=314773504 rios=192 wios=353 dbytes=0 dios=0
+ *
+ * io.stat is hierarchical, thus nested cgroups must not be listed twice.
+ *
+ * A cgroup which doesn't exist (any more) contributes nothing. Once removed,
+ * reading the open file fails (ENODEV); it's closed and opened again by path
+ * on the next poll. Whenever a cgroup comes or goes, its counters start over
+ * or vanish from the sums, thus 'cg_gen' is bumped to tell the main loop to
+ * take new baselines.
+ */
+static void read_cgroups(cgroup_t *cg)
+{
+  static char buf[16384];
+
+  cg_io_cnt = 0;
+
+  for (; cg != NULL; cg = cg->next) {
+    char *line;
+    char *next;
+    ssize_t len = 0;
+    ssize_t n = 0;
+
+    if (cg->fd < 0) {
+      cg->fd = open(cg->path, O_RDONLY);
+    }
+    if (cg->fd >= 0) {
+      while (len < (ssize_t) sizeof(buf) - 1 &&
+             (n = pread(cg->fd, buf + len, sizeof(buf) - 1 - len, len)) > 0) {
+        len += n;
+      }
+      if (len == 0 && n < 0) {
+        close(cg->fd);
+        cg->fd = -1;
+      }
+    }
+    if ((cg->fd >= 0) != cg->present) {
+      dprintf("%s: %s\n", cg->path, (cg->fd >= 0) ? "appeared" : "gone");
+      cg->present = (cg->fd >= 0);
+      cg_gen++;
+    }
+    if (cg->fd < 0) {
+      continue;
+    }
+    buf[len] = '\0';
+
+    for (line = buf; *line != '\0'; line = next) {
+      unsigned int major, minor;
+      cgroup_io_t *cio;
+      char *s;
+
+      if ((next = strchr(line, '\n')) != NULL) {
+        *next++ = '\0';
+      } else {
+        next = line + strlen(line);
+      }
+
+      if (sscanf(line, "%u:%u", &major, &minor) != 2) {
+        continue;
+      }
+
+      if ((cio = get_cgroup_io(major, minor)) == NULL) {
+        if (cg_io_cnt == cg_io_max) {
+          int max = (cg_io_max == 0) ? 16 : cg_io_max * 2;
+          if ((cio = realloc(cg_io, max * sizeof(*cg_io))) == NULL) {
+            /* this device's I/O simply isn't ignored */
+            fprintf(stderr, "out of memory\n");
+            continue;
+          }
+          cg_io = cio;
+          cg_io_max = max;
+        }
+        cio = cg_io + cg_io_cnt++;
+        cio->major = major;
+        cio->minor = minor;
+        cio->rios = 0;
+        cio->wios = 0;
+      }
+
+      if ((s = strstr(line, " rios=")) != NULL) {
+        cio->rios += (unsigned int) strtoul(s + 6, NULL, 10);
+      }
+      if ((s = strstr(line, " wios=")) != NULL) {
+        cio->wios += (unsigned int) strtoul(s + 6, NULL, 10);
+      }
+    }
+  }
+}
+
+/* get summed-up cgroup I/O counters by device number */
+static cgroup_io_t *get_cgroup_io(unsigned int major, unsigned int minor)
+{
+  int i;
+
+  for (i = 0; i < cg_io_cnt; i++) {
+    if (cg_io[i].major == major && cg_io[i].minor == minor) {
+      return(cg_io + i);
+    }
+  }
+
+  return(NULL);
 }
 
 /* vim: sw=2: ts=2: sts: et